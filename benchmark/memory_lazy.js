@@ -0,0 +1,33 @@
+import { mkdir, rm, writeFile } from "fs/promises";
+import { setTimeout } from "timers/promises";
+import { createWatcher, getStats, getTmpDir } from "./_util.js";
+
+// memory of eager watching grows with the tree, lazy watching
+// grows with the folders that are busy
+const main = async () => {
+  const tmpDir = await getTmpDir();
+  for (let i = 0; i < 100; i++) {
+    for (let j = 0; j < 100; j++) {
+      await mkdir(`${tmpDir}/${i}/${j}`, { recursive: true });
+    }
+  }
+  for (const args of [[], ["--lazy", "--max-depth", "0"]]) {
+    const watcher = await createWatcher([tmpDir, ...args]);
+    const initialStats = await getStats(watcher.pid);
+    // a small working set
+    for (let i = 0; i < 3; i++) {
+      for (let j = 0; j < 20; j++) {
+        await writeFile(`${tmpDir}/${i}/${j}.txt`, "");
+      }
+    }
+    await setTimeout(500);
+    const finalStats = await getStats(watcher.pid);
+    console.info(`${args.join(" ") || "eager"}`);
+    console.info(`  memory before: ${initialStats.memory}`);
+    console.info(`  memory after: ${finalStats.memory}`);
+    watcher.dispose();
+  }
+  await rm(tmpDir, { recursive: true, force: true });
+};
+
+main();
@@ -0,0 +1,60 @@
+import { spawn } from "child_process";
+import { mkdir, rm } from "fs/promises";
+import { createConnection } from "net";
+import { createWatcher, getStats, getTmpDir } from "./_util.js";
+
+// several tools watching the same tree: one process per tool compared to
+// one daemon with a client per tool
+const TOOLS = 8;
+const FOLDERS = 10_000;
+
+const subscribe = (socketPath, root) => {
+  return new Promise((resolve) => {
+    const socket = createConnection(socketPath);
+    socket.once("data", () => resolve(socket));
+    socket.write(`root ${root}\n\n`);
+  });
+};
+
+const main = async () => {
+  const tmpDir = await getTmpDir();
+  for (let i = 0; i < FOLDERS; i++) {
+    await mkdir(`${tmpDir}/${i % 100}/${i}`, { recursive: true });
+  }
+
+  let start = performance.now();
+  const watchers = [];
+  for (let i = 0; i < TOOLS; i++) {
+    watchers.push(await createWatcher([tmpDir]));
+  }
+  const processTime = performance.now() - start;
+  let processMemory = 0;
+  for (const watcher of watchers) {
+    processMemory += (await getStats(watcher.pid)).memory;
+    watcher.dispose();
+  }
+
+  const socketPath = `${tmpDir}.sock`;
+  const daemon = spawn("./hello", ["--socket", socketPath]);
+  await new Promise((resolve) => {
+    daemon.stderr.once("data", resolve);
+  });
+  start = performance.now();
+  const clients = [];
+  for (let i = 0; i < TOOLS; i++) {
+    clients.push(await subscribe(socketPath, tmpDir));
+  }
+  const daemonTime = performance.now() - start;
+  const daemonMemory = (await getStats(daemon.pid)).memory;
+  for (const client of clients) {
+    client.destroy();
+  }
+  daemon.kill();
+
+  console.info(`${TOOLS} processes: ${processTime.toFixed(0)}ms ${processMemory}`);
+  console.info(`1 daemon, ${TOOLS} clients: ${daemonTime.toFixed(0)}ms ${daemonMemory}`);
+  await rm(tmpDir, { recursive: true, force: true });
+  await rm(socketPath, { force: true });
+};
+
+main();
@@ -0,0 +1,405 @@
+import { spawn } from "child_process";
+import { mkdir, rename, rm, writeFile } from "fs/promises";
+import { setTimeout } from "timers/promises";
+import { pathToFileURL } from "url";
+import { getTmpDir } from "./_util.js";
+
+/**
+ * Randomized stress test with an oracle: random file operations are run
+ * against a watched folder while a model of the expected tree is kept.
+ * Afterwards the events of the watcher and its storage (printed on SIGUSR1)
+ * are compared with the model.
+ *
+ * Usage: node benchmark/stress.js [--seed 1] [--ops 2000]
+ *                                 [--rates 100,1000,max] [--shards 1]
+ */
+
+const MODELED_EVENTS = new Set([
+  "CREATE",
+  "CREATE_DIR",
+  "CLOSE_WRITE",
+  "DELETE",
+  "DELETE_DIR",
+  "MOVED_FROM",
+  "MOVED_FROM_DIR",
+  "MOVED_TO",
+  "MOVED_TO_DIR",
+]);
+
+// mulberry32
+const createRandom = (seed) => {
+  let state = seed >>> 0;
+  return () => {
+    state = (state + 0x6d2b79f5) >>> 0;
+    let t = state;
+    t = Math.imul(t ^ (t >>> 15), t | 1);
+    t ^= t + Math.imul(t ^ (t >>> 7), t | 61);
+    return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+  };
+};
+
+const startWatcher = async (args) => {
+  const child = spawn("./hello", args);
+  let stdout = "";
+  let stderr = "";
+  let lastOutput = Date.now();
+  let exitCode = null;
+  child.stdout.on("data", (data) => {
+    stdout += data.toString();
+    lastOutput = Date.now();
+  });
+  child.on("exit", (code, signal) => {
+    exitCode = code ?? signal;
+  });
+  await new Promise((resolve) => {
+    child.stderr.on("data", (data) => {
+      stderr += data.toString();
+      if (stderr.includes("Watches established.")) {
+        resolve();
+      }
+    });
+  });
+  return {
+    get stdout() {
+      return stdout;
+    },
+    get stderr() {
+      return stderr;
+    },
+    get exitCode() {
+      return exitCode;
+    },
+    get lastOutput() {
+      return lastOutput;
+    },
+    signal(name) {
+      child.kill(name);
+    },
+    dispose() {
+      child.kill();
+    },
+  };
+};
+
+const waitForQuiet = async (watcher, quietMs = 300) => {
+  while (Date.now() - watcher.lastOutput < quietMs) {
+    await setTimeout(50);
+  }
+};
+
+const readStorage = async (watcher, shards) => {
+  const offset = watcher.stderr.length;
+  watcher.signal("SIGUSR1");
+  const done = () => {
+    const output = watcher.stderr.slice(offset);
+    const sections = output.split("----- Storage -----").length - 1;
+    return sections === shards && output.endsWith("\n\n");
+  };
+  for (let i = 0; i < 100 && !done(); i++) {
+    await setTimeout(20);
+  }
+  return watcher.stderr
+    .slice(offset)
+    .split("\n")
+    .filter((line) => line.startsWith("node: "))
+    .map((line) => line.slice("node: ".length).replace(/^-?\d+ ?/, ""));
+};
+
+const countBy = (items) => {
+  const counts = new Map();
+  for (const item of items) {
+    counts.set(item, (counts.get(item) || 0) + 1);
+  }
+  return counts;
+};
+
+const difference = (a, b) => {
+  const result = [];
+  for (const [item, count] of a) {
+    for (let i = b.get(item) || 0; i < count; i++) {
+      result.push(item);
+    }
+  }
+  return result;
+};
+
+// same as shard_of_hash in src/lib.c
+export const shardOf = (path, shards) => {
+  let hash = 2166136261;
+  for (const byte of Buffer.from(path.split("/")[0])) {
+    hash = Math.imul(hash ^ byte, 16777619) >>> 0;
+  }
+  return hash % shards;
+};
+
+/**
+ * @param {{seed: number, ops: number, rate: number, shards?: number}} options
+ */
+export const runStress = async ({ seed, ops, rate, shards = 1 }) => {
+  const random = createRandom(seed);
+  const pick = (items) => items[Math.floor(random() * items.length)];
+  const root = await getTmpDir();
+  const outside = await getTmpDir();
+  // relative path -> "dir" | "file", "" is the root
+  const model = new Map([["", "dir"]]);
+  const seen = new Set([root]);
+  const expected = [];
+  // MOVED_FROM and MOVED_TO lines of each rename
+  const moves = [];
+  let nameCount = 0;
+  const newName = (prefix) => `${prefix}${nameCount++}`;
+  const abs = (path) => (path ? `${root}/${path}` : root);
+  const join = (dir, name) => (dir ? `${dir}/${name}` : name);
+  const entries = (type) =>
+    [...model].filter(([, t]) => !type || t === type).map(([p]) => p);
+  const subtree = (path) =>
+    entries().filter((p) => p === path || p.startsWith(`${path}/`));
+  const expect = (path, event) => {
+    seen.add(abs(path));
+    expected.push(`${abs(path)},${event}`);
+  };
+  // renamed top-level names stay with the shard of the name they had
+  const owners = new Map();
+  const ownerOf = (path) => {
+    const name = path.split("/")[0];
+    return owners.get(name) ?? shardOf(name, shards);
+  };
+  const suffix = (path) => (model.get(path) === "dir" ? "_DIR" : "");
+  // the contents of a new folder are reported as created
+  const expectContents = (path) => {
+    for (const p of subtree(path)) {
+      if (p !== path) {
+        expect(p, model.get(p) === "dir" ? "CREATE_DIR" : "CREATE");
+      }
+    }
+  };
+  const removeSubtree = (path) => {
+    for (const p of subtree(path)) {
+      model.delete(p);
+    }
+  };
+  const moveSubtree = (from, to) => {
+    for (const p of subtree(from)) {
+      const moved = to + p.slice(from.length);
+      model.set(moved, model.get(p));
+      model.delete(p);
+      seen.add(abs(moved));
+    }
+  };
+
+  const operations = {
+    async mkdir() {
+      const path = join(pick(entries("dir")), newName("d"));
+      await mkdir(abs(path));
+      model.set(path, "dir");
+      expect(path, "CREATE_DIR");
+    },
+    async write() {
+      const files = entries("file");
+      if (files.length > 0 && random() < 0.3) {
+        const path = pick(files);
+        await writeFile(abs(path), `${random()}`);
+        expect(path, "CLOSE_WRITE");
+      } else {
+        const path = join(pick(entries("dir")), newName("f"));
+        await writeFile(abs(path), `${random()}`);
+        model.set(path, "file");
+        expect(path, "CREATE");
+        expect(path, "CLOSE_WRITE");
+      }
+    },
+    async rm() {
+      const path = pick(entries().filter(Boolean));
+      if (path === undefined) return;
+      await rm(abs(path), { recursive: true });
+      // children are deleted before their parent
+      for (const p of subtree(path).reverse()) {
+        expect(p, model.get(p) === "dir" ? "DELETE_DIR" : "DELETE");
+      }
+      removeSubtree(path);
+    },
+    async rename() {
+      const path = pick(entries().filter(Boolean));
+      if (path === undefined) return;
+      const dirs = entries("dir").filter(
+        (p) => p !== path && !p.startsWith(`${path}/`)
+      );
+      const target = join(pick(dirs), newName(model.get(path)[0]));
+      await rename(abs(path), abs(target));
+      expect(path, `MOVED_FROM${suffix(path)}`);
+      moveSubtree(path, target);
+      expect(target, `MOVED_TO${suffix(target)}`);
+      moves.push(expected.slice(-2));
+      if (!path.includes("/") && !target.includes("/")) {
+        owners.set(target, ownerOf(path));
+      } else if (ownerOf(path) !== ownerOf(target)) {
+        // new folder for the shard of the target
+        expectContents(target);
+      }
+    },
+    async moveOut() {
+      const path = pick(entries().filter(Boolean));
+      if (path === undefined) return;
+      await rename(abs(path), `${outside}/${newName("o")}`);
+      expect(path, `MOVED_FROM${suffix(path)}`);
+      removeSubtree(path);
+    },
+    async moveIn() {
+      const name = newName("i");
+      const staged = `${outside}/${name}`;
+      const created = [["", "dir"]];
+      await mkdir(staged);
+      for (let i = Math.floor(random() * 4); i > 0; i--) {
+        const dirs = created.filter(([, t]) => t === "dir");
+        const parent = pick(dirs)[0];
+        const child = join(parent, newName(random() < 0.5 ? "d" : "f"));
+        if (child.split("/").pop()[0] === "d") {
+          await mkdir(`${staged}/${child}`);
+          created.push([child, "dir"]);
+        } else {
+          await writeFile(`${staged}/${child}`, "");
+          created.push([child, "file"]);
+        }
+      }
+      const target = join(pick(entries("dir")), name);
+      await rename(staged, abs(target));
+      for (const [p, t] of created) {
+        model.set(p ? `${target}/${p}` : target, t);
+        seen.add(abs(p ? `${target}/${p}` : target));
+      }
+      expect(target, "MOVED_TO_DIR");
+      expectContents(target);
+    },
+  };
+  const weighted = [
+    ...Array(3).fill("mkdir"),
+    ...Array(4).fill("write"),
+    "rm",
+    ...Array(2).fill("rename"),
+    "moveOut",
+    "moveIn",
+  ];
+
+  const args = [root];
+  if (shards > 1) {
+    args.push("--shards", `${shards}`);
+  }
+  const watcher = await startWatcher(args);
+  const delay = Number.isFinite(rate) ? 1000 / rate : 0;
+  const start = performance.now();
+  for (let i = 0; i < ops; i++) {
+    const next = start + i * delay;
+    const now = performance.now();
+    if (next > now) {
+      await setTimeout(next - now);
+    }
+    await operations[pick(weighted)]();
+  }
+  const elapsed = performance.now() - start;
+  await waitForQuiet(watcher);
+
+  const actual = watcher.stdout
+    .split("\n")
+    .filter(Boolean)
+    .filter((line) => MODELED_EVENTS.has(line.slice(line.lastIndexOf(",") + 1)));
+  const expectedCounts = countBy(expected);
+  const actualCounts = countBy(actual);
+  const stale = actual.filter(
+    (line) => !seen.has(line.slice(0, line.lastIndexOf(",")))
+  );
+
+  const positions = new Map();
+  actual.forEach((line, i) => {
+    positions.set(line, [...(positions.get(line) || []), i]);
+  });
+  // MOVED_TO printed before its MOVED_FROM
+  const misordered = moves.filter(([from, to]) => {
+    const fromIndex = positions.get(from)?.shift();
+    const toIndex = positions.get(to)?.shift();
+    return fromIndex !== undefined && toIndex !== undefined && toIndex < fromIndex;
+  });
+
+  const watched = watcher.exitCode === null ? await readStorage(watcher, shards) : [];
+  const watchedCounts = countBy(watched);
+  const dirs = countBy(entries("dir").map(abs));
+  // every shard watches the root folder
+  dirs.set(root, shards);
+  const result = {
+    seed,
+    rate,
+    ops,
+    opsPerSecond: Math.round((ops / elapsed) * 1000),
+    expected: expected.length,
+    missed: difference(expectedCounts, actualCounts),
+    spurious: difference(actualCounts, expectedCounts),
+    stale,
+    misordered,
+    leakedWatches: difference(watchedCounts, dirs),
+    missingWatches: difference(dirs, watchedCounts),
+    // exit code or signal when the watcher died
+    crashed: watcher.exitCode,
+    stderr: watcher.stderr,
+  };
+  watcher.dispose();
+  await rm(root, { recursive: true, force: true });
+  await rm(outside, { recursive: true, force: true });
+  return result;
+};
+
+const parseArgs = (argv) => {
+  const options = { seed: 1, ops: 2000, rates: [100, 1000, Infinity], shards: 1 };
+  for (let i = 0; i < argv.length; i += 2) {
+    const value = argv[i + 1];
+    switch (argv[i]) {
+      case "--seed":
+        options.seed = Number(value);
+        break;
+      case "--ops":
+        options.ops = Number(value);
+        break;
+      case "--rates":
+        options.rates = value
+          .split(",")
+          .map((rate) => (rate === "max" ? Infinity : Number(rate)));
+        break;
+      case "--shards":
+        options.shards = Number(value);
+        break;
+      default:
+        throw new Error(`unknown option ${argv[i]}`);
+    }
+  }
+  return options;
+};
+
+const main = async () => {
+  const { seed, ops, rates, shards } = parseArgs(process.argv.slice(2));
+  const rows = [];
+  for (const rate of rates) {
+    const result = await runStress({ seed, ops, rate, shards });
+    rows.push({
+      rate: Number.isFinite(rate) ? rate : "max",
+      "ops/s": result.opsPerSecond,
+      expected: result.expected,
+      missed: result.missed.length,
+      spurious: result.spurious.length,
+      stale: result.stale.length,
+      misordered: result.misordered.length,
+      "leaked watches": result.leakedWatches.length,
+      "missing watches": result.missingWatches.length,
+      crashed: result.crashed,
+    });
+    if (result.crashed !== null) {
+      console.info(`rate ${rate}, watcher died:`, result.stderr.slice(-500));
+    }
+    if (result.missed.length || result.stale.length) {
+      console.info(`rate ${rate}, first missed:`, result.missed.slice(0, 5));
+      console.info(`rate ${rate}, first stale:`, result.stale.slice(0, 5));
+    }
+  }
+  console.table(rows);
+};
+
+if (import.meta.url === pathToFileURL(process.argv[1]).href) {
+  main();
+}
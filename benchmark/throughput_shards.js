@@ -0,0 +1,104 @@
+import { fork, spawn } from "child_process";
+import { writeFileSync } from "fs";
+import { mkdir, readdir, readFile } from "fs/promises";
+import { getTmpDir } from "./_util.js";
+
+const SUBTREES = 8;
+const FOLDERS_PER_SUBTREE = 500;
+const FILES_PER_SUBTREE = 500;
+
+const waitForReady = (child) =>
+  new Promise((resolve) => {
+    const handleData = (data) => {
+      if (data.toString().includes("Watches established.")) {
+        child.stderr.off("data", handleData);
+        resolve();
+      }
+    };
+    child.stderr.on("data", handleData);
+  });
+
+// CPU time in ms of each thread of the process, the scheduler counts
+// nanoseconds
+const threadTimes = async (pid) => {
+  const times = new Map();
+  for (const tid of await readdir(`/proc/${pid}/task`)) {
+    const schedstat = await readFile(`/proc/${pid}/task/${tid}/schedstat`, "utf8");
+    times.set(tid, Number(schedstat.split(" ")[0]) / 1e6);
+  }
+  return times;
+};
+
+// one writer process per subtree, so that the writers are not limited by
+// the event loop of a single process
+const runWriter = () => {
+  const [folder, prefix] = process.argv.slice(3);
+  process.on("message", () => {
+    for (let j = 0; j < FILES_PER_SUBTREE; j++) {
+      writeFileSync(`${folder}/${prefix}-${j}.txt`, "");
+    }
+    process.disconnect();
+  });
+  process.send("ready");
+};
+
+const startWriter = (folder, prefix) =>
+  new Promise((resolve) => {
+    const child = fork(process.argv[1], ["--writer", folder, prefix]);
+    child.once("message", () => resolve(child));
+  });
+
+const run = async (tmpDir, shards) => {
+  const child = spawn("./hello", [tmpDir, "--shards", `${shards}`]);
+  let lines = 0;
+  await waitForReady(child);
+  const expected = SUBTREES * FILES_PER_SUBTREE * 2;
+  const done = new Promise((resolve) => {
+    child.stdout.on("data", (data) => {
+      lines += data.toString().split("\n").length - 1;
+      if (lines >= expected) {
+        resolve();
+      }
+    });
+  });
+  const writers = await Promise.all(
+    Array.from({ length: SUBTREES }, (_, i) =>
+      startWriter(`${tmpDir}/${i}`, `${shards}`)
+    )
+  );
+  const before = await threadTimes(child.pid);
+  const start = performance.now();
+  for (const writer of writers) {
+    writer.send("go");
+  }
+  await done;
+  const end = performance.now();
+  const after = await threadTimes(child.pid);
+  child.kill();
+  const used = [...after].map(([tid, time]) => time - (before.get(tid) || 0));
+  const cpu = used.reduce((sum, time) => sum + time, 0);
+  // with a core per shard the run takes at least as long as the busiest
+  // thread, the speedup over one shard is bounded by cpu / busiest
+  const busiest = Math.max(...used);
+  console.info(
+    `shards ${shards}: ${(end - start).toFixed(0)}ms, cpu ${cpu.toFixed(0)}ms, busiest thread ${busiest.toFixed(0)}ms`
+  );
+};
+
+const main = async () => {
+  const tmpDir = await getTmpDir();
+  for (let i = 0; i < SUBTREES; i++) {
+    for (let j = 0; j < FOLDERS_PER_SUBTREE; j++) {
+      await mkdir(`${tmpDir}/${i}/${j}`, { recursive: true });
+    }
+  }
+  for (const shards of [1, 2, 4, 8]) {
+    await run(tmpDir, shards);
+  }
+};
+
+if (process.argv[2] === "--writer") {
+  runWriter();
+} else {
+  main();
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "digest.h"
+#include "path.h"
+
+// files larger than this are not hashed
+long digest_max_size = 64 * 1024 * 1024;
+// maximum number of digests kept in memory
+int digest_cache_size = 65536;
+
+/* xxHash64, the file is read in chunks that are a multiple of the 32 byte
+   stripe size so that only the last chunk has a tail. */
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+#define CHUNK_SIZE (1024 * 1024)
+
+typedef struct HashState {
+    uint64_t v[4];
+    uint64_t total_len;
+} HashState;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t hash_merge_round(uint64_t acc, uint64_t value) {
+    acc ^= hash_round(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+static void hash_init(HashState *state) {
+    state->v[0] = PRIME1 + PRIME2;
+    state->v[1] = PRIME2;
+    state->v[2] = 0;
+    state->v[3] = -PRIME1;
+    state->total_len = 0;
+}
+
+static void hash_stripes(HashState *state, const unsigned char *p,
+                         size_t len) {
+    const unsigned char *end = p + len;
+    for (; p + 32 <= end; p += 32) {
+        state->v[0] = hash_round(state->v[0], read64(p));
+        state->v[1] = hash_round(state->v[1], read64(p + 8));
+        state->v[2] = hash_round(state->v[2], read64(p + 16));
+        state->v[3] = hash_round(state->v[3], read64(p + 24));
+    }
+    state->total_len += len;
+}
+
+static uint64_t hash_finish(HashState *state, const unsigned char *p,
+                            size_t len) {
+    uint64_t h;
+    if (state->total_len >= 32 || len >= 32) {
+        size_t stripes = len & ~(size_t)31;
+        hash_stripes(state, p, stripes);
+        p += stripes;
+        len -= stripes;
+        h = rotl(state->v[0], 1) + rotl(state->v[1], 7) +
+            rotl(state->v[2], 12) + rotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = hash_merge_round(h, state->v[i]);
+        }
+    } else {
+        h = PRIME5;
+    }
+    h += state->total_len + len;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= hash_round(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Fills buf as far as possible, returns less than count only at the end of
+   the file. */
+static ssize_t read_chunk(int fd, unsigned char *buf, size_t count,
+                          off_t offset) {
+    size_t total = 0;
+    while (total < count) {
+        ssize_t len = pread(fd, buf + total, count - total, offset + total);
+        if (len == -1) {
+            return -1;
+        }
+        if (len == 0) {
+            break;
+        }
+        total += len;
+    }
+    return total;
+}
+
+static __thread unsigned char *chunk;
+
+static int hash_file(const char *fpath, uint64_t *digest) {
+    int fd = open(fpath, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) {
+        // file might have already been removed
+        return -1;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+        sb.st_size > digest_max_size) {
+        close(fd);
+        return -1;
+    }
+    if (chunk == NULL) {
+        chunk = malloc(CHUNK_SIZE);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    HashState state;
+    hash_init(&state);
+    off_t offset = 0;
+    for (;;) {
+        ssize_t len = read_chunk(fd, chunk, CHUNK_SIZE, offset);
+        if (len == -1) {
+            close(fd);
+            return -1;
+        }
+        if (len < CHUNK_SIZE) {
+            *digest = hash_finish(&state, chunk, len);
+            break;
+        }
+        hash_stripes(&state, chunk, len);
+        offset += len;
+    }
+    close(fd);
+    return 0;
+}
+
+/* LRU cache of digests by path. The hash table resolves collisions by
+   chaining, the doubly linked list has the most recently used entry first.
+   The entries are also indexed by their parent folder in a tree of the
+   folders that have cached files below them, so that the digests below a
+   folder are forgotten without scanning the whole cache. */
+
+struct DigestEntry;
+
+typedef struct DigestFolder {
+    char *path;
+    struct DigestFolder *parent;
+    struct DigestFolder *children;
+    struct DigestFolder *prev;
+    struct DigestFolder *next;
+    struct DigestEntry *files;
+    struct DigestFolder *bucket_next;
+} DigestFolder;
+
+typedef struct DigestEntry {
+    char *fpath;
+    uint64_t digest;
+    struct DigestEntry *prev;
+    struct DigestEntry *next;
+    struct DigestEntry *bucket_next;
+    DigestFolder *folder;
+    struct DigestEntry *folder_prev;
+    struct DigestEntry *folder_next;
+} DigestEntry;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static DigestEntry **buckets = NULL;
+static DigestFolder **folder_buckets = NULL;
+static size_t bucket_count = 0;
+static DigestEntry *lru_head = NULL;
+static DigestEntry *lru_tail = NULL;
+static int entry_count = 0;
+
+static size_t bucket_of(const char *fpath) {
+    return path_hash(fpath, strlen(fpath)) & (bucket_count - 1);
+}
+
+/* Length of the parent folder of the first len characters of fpath, -1 at
+   the top. */
+static ssize_t parent_length(const char *fpath, size_t len) {
+    const char *slash = memrchr(fpath, '/', len);
+    if (slash == NULL || len == 1) {
+        return -1;
+    }
+    return slash == fpath ? 1 : slash - fpath;
+}
+
+static DigestFolder **folder_find(const char *fpath, size_t len) {
+    DigestFolder **slot =
+        &folder_buckets[path_hash(fpath, len) & (bucket_count - 1)];
+    while (*slot != NULL && (strncmp((*slot)->path, fpath, len) != 0 ||
+                             (*slot)->path[len] != '\0')) {
+        slot = &(*slot)->bucket_next;
+    }
+    return slot;
+}
+
+/* Returns the folder of the first len characters of fpath, adds it and its
+   parents when missing. */
+static DigestFolder *folder_get(const char *fpath, size_t len) {
+    DigestFolder **slot = folder_find(fpath, len);
+    if (*slot != NULL) {
+        return *slot;
+    }
+    DigestFolder *folder = calloc(1, sizeof(DigestFolder));
+    folder->path = strndup(fpath, len);
+    *slot = folder;
+    ssize_t parent_len = parent_length(fpath, len);
+    if (parent_len != -1) {
+        folder->parent = folder_get(fpath, parent_len);
+        folder->next = folder->parent->children;
+        if (folder->next) {
+            folder->next->prev = folder;
+        }
+        folder->parent->children = folder;
+    }
+    return folder;
+}
+
+static void folder_remove(DigestFolder *folder) {
+    if (folder->prev) {
+        folder->prev->next = folder->next;
+    } else if (folder->parent) {
+        folder->parent->children = folder->next;
+    }
+    if (folder->next) {
+        folder->next->prev = folder->prev;
+    }
+    DigestFolder **slot = folder_find(folder->path, strlen(folder->path));
+    *slot = folder->bucket_next;
+    free(folder->path);
+    free(folder);
+}
+
+/* Removes the folder and its parents as long as nothing is cached below
+   them. */
+static void folder_release(DigestFolder *folder) {
+    while (folder != NULL && folder->files == NULL &&
+           folder->children == NULL) {
+        DigestFolder *parent = folder->parent;
+        folder_remove(folder);
+        folder = parent;
+    }
+}
+
+static void folder_add_file(DigestEntry *entry) {
+    entry->folder = NULL;
+    entry->folder_prev = NULL;
+    entry->folder_next = NULL;
+    ssize_t len = parent_length(entry->fpath, strlen(entry->fpath));
+    if (len == -1) {
+        return;
+    }
+    entry->folder = folder_get(entry->fpath, len);
+    entry->folder_next = entry->folder->files;
+    if (entry->folder_next) {
+        entry->folder_next->folder_prev = entry;
+    }
+    entry->folder->files = entry;
+}
+
+static void folder_unlink_file(DigestEntry *entry) {
+    if (entry->folder_prev) {
+        entry->folder_prev->folder_next = entry->folder_next;
+    } else if (entry->folder) {
+        entry->folder->files = entry->folder_next;
+    }
+    if (entry->folder_next) {
+        entry->folder_next->folder_prev = entry->folder_prev;
+    }
+}
+
+static void lru_unlink(DigestEntry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        lru_head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        lru_tail = entry->prev;
+    }
+}
+
+static void lru_push_front(DigestEntry *entry) {
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head) {
+        lru_head->prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+static DigestEntry **cache_find(const char *fpath) {
+    DigestEntry **slot = &buckets[bucket_of(fpath)];
+    while (*slot != NULL && strcmp((*slot)->fpath, fpath) != 0) {
+        slot = &(*slot)->bucket_next;
+    }
+    return slot;
+}
+
+static void cache_remove(DigestEntry **slot) {
+    DigestEntry *entry = *slot;
+    *slot = entry->bucket_next;
+    lru_unlink(entry);
+    folder_unlink_file(entry);
+    free(entry->fpath);
+    free(entry);
+    entry_count--;
+}
+
+/* Removes the entry and the folders that are left empty. */
+static void cache_evict(DigestEntry **slot) {
+    DigestFolder *folder = (*slot)->folder;
+    cache_remove(slot);
+    folder_release(folder);
+}
+
+/* Removes the folder with all entries and folders below it. */
+static void cache_remove_folder(DigestFolder *folder) {
+    while (folder->children != NULL) {
+        cache_remove_folder(folder->children);
+    }
+    while (folder->files != NULL) {
+        cache_remove(cache_find(folder->files->fpath));
+    }
+    folder_remove(folder);
+}
+
+static void cache_init() {
+    bucket_count = 1;
+    while (bucket_count < (size_t)digest_cache_size) {
+        bucket_count <<= 1;
+    }
+    buckets = calloc(bucket_count, sizeof(DigestEntry *));
+    folder_buckets = calloc(bucket_count, sizeof(DigestFolder *));
+}
+
+/* Hashes the file and stores the digest as hex. Returns DIGEST_UNCHANGED
+   when the digest is the same as the last time, DIGEST_SKIPPED when the
+   file could not be hashed. */
+int digest_update(const char *fpath, char *hex) {
+    uint64_t digest;
+    if (hash_file(fpath, &digest) == -1) {
+        digest_forget(fpath);
+        return DIGEST_SKIPPED;
+    }
+    snprintf(hex, DIGEST_HEX_LENGTH + 1, "%016llx",
+             (unsigned long long)digest);
+
+    pthread_mutex_lock(&cache_mutex);
+    if (buckets == NULL) {
+        cache_init();
+    }
+    int status = DIGEST_CHANGED;
+    DigestEntry **slot = cache_find(fpath);
+    DigestEntry *entry = *slot;
+    if (entry != NULL) {
+        if (entry->digest == digest) {
+            status = DIGEST_UNCHANGED;
+        }
+        entry->digest = digest;
+        lru_unlink(entry);
+        lru_push_front(entry);
+    } else {
+        if (entry_count >= digest_cache_size) {
+            cache_evict(cache_find(lru_tail->fpath));
+        }
+        entry = malloc(sizeof(DigestEntry));
+        entry->fpath = strdup(fpath);
+        entry->digest = digest;
+        entry->bucket_next = buckets[bucket_of(fpath)];
+        buckets[bucket_of(fpath)] = entry;
+        lru_push_front(entry);
+        folder_add_file(entry);
+        entry_count++;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return status;
+}
+
+void digest_forget(const char *fpath) {
+    pthread_mutex_lock(&cache_mutex);
+    if (buckets != NULL) {
+        DigestEntry **slot = cache_find(fpath);
+        if (*slot != NULL) {
+            cache_evict(slot);
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/* Forgets the digests of all files below folder. */
+void digest_forget_prefix(const char *folder) {
+    pthread_mutex_lock(&cache_mutex);
+    if (buckets != NULL) {
+        DigestFolder *found = *folder_find(folder, strlen(folder));
+        if (found != NULL) {
+            DigestFolder *parent = found->parent;
+            cache_remove_folder(found);
+            folder_release(parent);
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
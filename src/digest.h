@@ -0,0 +1,13 @@
+#define DIGEST_HEX_LENGTH 16
+
+enum { DIGEST_CHANGED, DIGEST_UNCHANGED, DIGEST_SKIPPED };
+
+extern long digest_max_size;
+
+extern int digest_cache_size;
+
+int digest_update(const char *fpath, char *hex);
+
+void digest_forget(const char *fpath);
+
+void digest_forget_prefix(const char *folder);
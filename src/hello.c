@@ -20,13 +20,46 @@
 
 extern char** exclude;
 extern int excludec;
+extern int shardc;
+extern int with_hash;
+extern int with_stat;
+extern int max_depth;
+extern int lazy;
+extern int idle_timeout;
+extern int follow_symlinks;
+extern long digest_max_size;
+extern int digest_cache_size;
 
-static const char short_options[] = "e:hv";
+#define MAX_SHARDS 64
+
+enum {
+    OPTION_HASH = 256,
+    OPTION_HASH_MAX_SIZE,
+    OPTION_HASH_CACHE_SIZE,
+    OPTION_WITH_STAT,
+    OPTION_SOCKET,
+    OPTION_MAX_DEPTH,
+    OPTION_LAZY,
+    OPTION_IDLE_TIMEOUT,
+    OPTION_FOLLOW_SYMLINKS
+};
+
+static const char short_options[] = "e:s:hv";
 
 static const struct option long_options[] = {
     {"help", no_argument, 0, 'h'},
     {"version", no_argument, 0, 'v'},
     {"exclude", required_argument, 0, 'e'},
+    {"shards", required_argument, 0, 's'},
+    {"hash", no_argument, 0, OPTION_HASH},
+    {"hash-max-size", required_argument, 0, OPTION_HASH_MAX_SIZE},
+    {"hash-cache-size", required_argument, 0, OPTION_HASH_CACHE_SIZE},
+    {"with-stat", no_argument, 0, OPTION_WITH_STAT},
+    {"socket", required_argument, 0, OPTION_SOCKET},
+    {"max-depth", required_argument, 0, OPTION_MAX_DEPTH},
+    {"lazy", no_argument, 0, OPTION_LAZY},
+    {"idle-timeout", required_argument, 0, OPTION_IDLE_TIMEOUT},
+    {"follow-symlinks", no_argument, 0, OPTION_FOLLOW_SYMLINKS},
     {0, 0, 0, 0}};
 
 static void print_help() {
@@ -38,6 +71,40 @@ static void print_help() {
     printf(
         "\t--exclude <name>\n"
         "\t              \tExclude all events on files matching <name>\n");
+    printf(
+        "\t--shards <n>  \tSplit top-level folders across <n> inotify\n"
+        "\t              \tinstances, each read by its own thread\n");
+    printf(
+        "\t--hash        \tHash files on CLOSE_WRITE and skip the event\n"
+        "\t              \twhen the content did not change, the digest\n"
+        "\t              \tis printed in an extra column\n");
+    printf(
+        "\t--hash-max-size <bytes>\n"
+        "\t              \tDo not hash files larger than <bytes>\n");
+    printf(
+        "\t--hash-cache-size <n>\n"
+        "\t              \tRemember the digests of at most <n> files\n");
+    printf(
+        "\t--with-stat   \tAdd type, size, mtime and inode to each event\n");
+    printf(
+        "\t--socket <path>\n"
+        "\t              \tServe clients on the unix socket <path>, which\n"
+        "\t              \tsubscribe to folders instead of sample-folder\n");
+    printf(
+        "\t--max-depth <n>\n"
+        "\t              \tOnly watch folders up to <n> levels deep\n");
+    printf(
+        "\t--lazy        \tWatch the folders below --max-depth for created,\n"
+        "\t              \tdeleted and moved entries only and watch them\n"
+        "\t              \tfully while they are busy\n");
+    printf(
+        "\t--idle-timeout <seconds>\n"
+        "\t              \tWith --lazy, stop fully watching folders without\n"
+        "\t              \tevents for <seconds> (default 60)\n");
+    printf(
+        "\t--follow-symlinks\n"
+        "\t              \tWatch the folders that symlinks point to and\n"
+        "\t              \treport their events below every path of them\n");
 }
 
 static void print_usage() {
@@ -50,6 +117,7 @@ int main(int argc, char* argv[]) {
     int help = 0;
     int version = 0;
     char* folder = 0;
+    char* socket_path = 0;
 
     while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) !=
            -1) {
@@ -75,6 +143,56 @@ int main(int argc, char* argv[]) {
                 }
                 excludec++;
                 break;
+            case 's':
+                shardc = atoi(optarg);
+                if (shardc < 1 || shardc > MAX_SHARDS) {
+                    print_usage();
+                    exit(2);
+                }
+                break;
+            case OPTION_HASH:
+                with_hash = 1;
+                break;
+            case OPTION_HASH_MAX_SIZE:
+                digest_max_size = atol(optarg);
+                if (digest_max_size < 0) {
+                    print_usage();
+                    exit(2);
+                }
+                break;
+            case OPTION_HASH_CACHE_SIZE:
+                digest_cache_size = atoi(optarg);
+                if (digest_cache_size < 1) {
+                    print_usage();
+                    exit(2);
+                }
+                break;
+            case OPTION_WITH_STAT:
+                with_stat = 1;
+                break;
+            case OPTION_SOCKET:
+                socket_path = optarg;
+                break;
+            case OPTION_MAX_DEPTH:
+                max_depth = atoi(optarg);
+                if (max_depth < 0 || optarg[0] < '0' || optarg[0] > '9') {
+                    print_usage();
+                    exit(2);
+                }
+                break;
+            case OPTION_LAZY:
+                lazy = 1;
+                break;
+            case OPTION_IDLE_TIMEOUT:
+                idle_timeout = atoi(optarg);
+                if (idle_timeout < 1) {
+                    print_usage();
+                    exit(2);
+                }
+                break;
+            case OPTION_FOLLOW_SYMLINKS:
+                follow_symlinks = 1;
+                break;
             case 'v':
                 version = 1;
                 break;
@@ -95,6 +213,19 @@ int main(int argc, char* argv[]) {
         print_help();
         exit(EXIT_SUCCESS);
     }
+    if (lazy && max_depth < 0) {
+        // only the root folder is active
+        max_depth = 0;
+    }
+    if (socket_path) {
+        // shards split one folder, clients subscribe to many
+        if (shardc > 1 || optind < argc) {
+            print_usage();
+            exit(2);
+        }
+        serve(socket_path);
+        exit(EXIT_SUCCESS);
+    }
     if (optind < argc) {
         folder = argv[optind];
     } else {
@@ -4,22 +4,92 @@
 #include <errno.h>
 #include <ftw.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "csv.h"
+#include "digest.h"
+#include "metadata.h"
 #include "notify.h"
+#include "path.h"
+#include "server.h"
 #include "storage.h"
 
-extern int fd;
+extern __thread int fd;
 char **exclude;
 int excludec = 0;
+int shardc = 1;
+int with_hash = 0;
+int with_stat = 0;
+// folders deeper than this below the root are not watched, -1 = unlimited
+int max_depth = -1;
+int lazy = 0;
+int idle_timeout = 60;
+int follow_symlinks = 0;
 
-char *moved_from = 0;
+static __thread char *moved_from = 0;
+static __thread int moved_from_wd = 0;
+static __thread uint32_t moved_from_cookie = 0;
+// inotify hands out increasing watch descriptors
+static __thread int max_wd = 0;
+
+/* Sharded mode: every top-level subtree of the watched folder is owned by
+   one shard, which has its own inotify instance, storage and reader thread.
+   Every shard also watches the root folder itself and handles the events of
+   the top-level names it owns, so moves of top-level folders are queued in
+   order with the events inside of them. A top-level name is owned by the
+   shard of its hash, unless it has been renamed from another top-level name,
+   then it stays with the shard of that name. */
+
+typedef struct Shard {
+    int id;
+    // the main thread asks the shard to print its storage
+    int dump[2];
+    pthread_t thread;
+    // inotify instance of the shard
+    int fd;
+    // moves_mutex: handling a batch of events, number of batches handled
+    bool reading;
+    int batches;
+    // moves_mutex: cookie of the MOVED_TO the shard waits with, or 0
+    uint32_t waiting_for;
+} Shard;
+
+static const char *root;
+static Shard *shards;
+static pthread_barrier_t shards_ready;
+
+/* Daemon mode: the folders that clients of the socket subscribe to share
+   one inotify instance and storage. A root is crawled once and stays
+   watched while a client is subscribed to it or to a folder containing it.
+   */
+
+typedef struct Root {
+    char *fpath;
+    int refs;
+    struct Root *next;
+} Root;
+
+static bool serving = false;
+static Root *roots = NULL;
+
+// SIGUSR1 prints the storage to stderr
+static int signal_fd = -1;
+
+static __thread int shard_id = 0;
+static __thread FILE *out;
+static __thread char *out_buf;
+static __thread size_t out_size;
 
 const char *get_event_string(const struct inotify_event *event) {
     switch (event->mask) {
@@ -76,9 +146,110 @@ static bool is_excluded_folder(const char *fpath) {
     return is_excluded_name(slash + 1);
 }
 
-static void full_path(char **fpath, const struct inotify_event *event) {
+typedef struct Owner {
+    char *name;
+    int shard;
+    struct Owner *next;
+} Owner;
+
+// renamed top-level names that are not owned by the shard of their hash
+static __thread Owner *owners = NULL;
+// name of a top-level MOVED_FROM event that waits for its MOVED_TO event
+static __thread char *root_moved_from = NULL;
+static __thread uint32_t root_moved_cookie = 0;
+
+static int shard_of_hash(const char *name) {
+    return path_hash(name, strcspn(name, "/")) % shardc;
+}
+
+/* Returns the slot of the top-level name that name starts with. */
+static Owner **owner_find(const char *name) {
+    size_t len = strcspn(name, "/");
+    Owner **slot = &owners;
+    while (*slot != NULL && (strncmp((*slot)->name, name, len) != 0 ||
+                             (*slot)->name[len] != '\0')) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static int shard_of_name(const char *name) {
+    Owner *owner = *owner_find(name);
+    return owner != NULL ? owner->shard : shard_of_hash(name);
+}
+
+static void set_owner(const char *name, int shard) {
+    Owner **slot = owner_find(name);
+    if (*slot != NULL) {
+        Owner *owner = *slot;
+        *slot = owner->next;
+        free(owner->name);
+        free(owner);
+    }
+    if (shard != shard_of_hash(name)) {
+        Owner *owner = malloc(sizeof(Owner));
+        owner->name = strdup(name);
+        owner->shard = shard;
+        owner->next = owners;
+        owners = owner;
+    }
+}
+
+/* Returns the shard owning fpath, determined by its top-level folder. */
+static int shard_of_path(const char *fpath) {
+    if (shardc == 1) {
+        return 0;
+    }
+    const char *name = fpath + strlen(root);
+    while (*name == '/') {
+        name++;
+    }
+    if (*name == '\0') {
+        // every shard watches the root folder
+        return shard_id;
+    }
+    return shard_of_name(name);
+}
+
+/* Returns false for events of top-level names owned by another shard. */
+static bool is_owned(const ListNode *node, const struct inotify_event *event) {
+    if (shardc == 1 || strcmp(node->fpath, root) != 0) {
+        return true;
+    }
+    return shard_of_name(event->name) == shard_id;
+}
+
+/* Every shard sees the same events of the root folder in the same order, so
+   all shards agree on the owners of renamed top-level names. */
+static void track_owners(const struct inotify_event *event) {
     ListNode *node = storage_find(event->wd);
-    if (asprintf(fpath, "%s/%s", node->fpath, event->name) == -1) {
+    if (node == NULL || !event->len || strcmp(node->fpath, root) != 0) {
+        return;
+    }
+    if (root_moved_from != NULL) {
+        int shard = shard_of_name(root_moved_from);
+        set_owner(root_moved_from, shard_of_hash(root_moved_from));
+        bool renamed = event->mask & IN_MOVED_TO &&
+                       event->cookie == root_moved_cookie;
+        free(root_moved_from);
+        root_moved_from = NULL;
+        if (renamed) {
+            // renamed in the root folder, stays with the same shard
+            set_owner(event->name, shard);
+            return;
+        }
+    }
+    if (event->mask & IN_MOVED_FROM) {
+        root_moved_from = strdup(event->name);
+        root_moved_cookie = event->cookie;
+    } else if (event->mask & (IN_CREATE | IN_MOVED_TO | IN_DELETE)) {
+        // a new name or no name anymore
+        set_owner(event->name, shard_of_hash(event->name));
+    }
+}
+
+static void join_path(char **fpath, const char *dir, const char *name) {
+    if (asprintf(fpath, "%s/%s", dir, name) == -1) {
         fprintf(stderr, "asprintf error");
         fflush(stderr);
         perror("asprintf");
@@ -86,36 +257,282 @@ static void full_path(char **fpath, const struct inotify_event *event) {
     }
 }
 
-static void add_watch(const char *fpath) {
-    int wd = notify_add_watch(fpath);
+static void full_path(char **fpath, const struct inotify_event *event) {
+    join_path(fpath, storage_find(event->wd)->fpath, event->name);
+}
+
+/* Lazy mode: a structure-only folder with this many events within one
+   second is activated. */
+#define LAZY_BUSY_EVENTS 8
+
+static __thread int crawl_depth = 0;
+// the crawl is inside an activated folder, watched fully at every depth
+static __thread bool crawl_full = false;
+
+static int now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/* Returns how a folder at depth is watched, -1 when it is not watched. The
+   folders right below the depth limit are watched for structural changes
+   only, so that they can be activated when they get busy. */
+static int mode_at_depth(int depth) {
+    if (crawl_full || max_depth < 0 || depth <= max_depth) {
+        return WATCH_FULL;
+    }
+    if (lazy && depth == max_depth + 1) {
+        return WATCH_STRUCTURE;
+    }
+    return -1;
+}
+
+/* Returns the node of the folder, its fpath is another path when the
+   folder is already watched through that path. */
+static ListNode *add_watch(const char *fpath, const struct stat *sb, int depth,
+                           int mode) {
+    struct stat st;
+    if (sb == NULL) {
+        if (stat(fpath, &st) == -1) {
+            return NULL;
+        }
+        sb = &st;
+    }
+    int wd = notify_add_watch(fpath, mode);
     // fprintf(fp, "ADD WATCH %d %s\n", wd, fpath);
+    if (wd == -1) {
+        return NULL;
+    }
+    if (wd <= max_wd) {
+        ListNode *node = storage_find(wd);
+        if (node != NULL) {
+            if (strcmp(node->fpath, fpath) == 0) {
+                // watched again, e.g. to watch it fully
+            } else if (storage_is_same_folder(node->fpath, node)) {
+                // symlink, bind mount or hardlinked folder
+                storage_add_alias(node, fpath);
+            } else {
+                // folder is already watched under the path it was moved
+                // from, the removal of that path is still queued
+                storage_update(node, fpath);
+            }
+            if (mode == WATCH_FULL) {
+                node->mode = WATCH_FULL;
+            }
+            if (depth < node->depth) {
+                node->depth = depth;
+            }
+            return node;
+        }
+    } else {
+        max_wd = wd;
+    }
 
     // TODO use dynamic array (or better tree)
-    storage_add(wd, fpath);
+    ListNode *node = storage_add(wd, fpath, sb->st_dev, sb->st_ino);
+    node->depth = depth;
+    node->mode = mode;
+    node->last_event = now_seconds();
     // storage_print(fp);
     // storage_print(stdout);
+    return node;
 }
 
 static void remove_watch_by_path(const char *fpath) {
     storage_find_and_remove_by_path(fpath, notify_remove_watch);
 }
 
-static int visit_dirent(const char *fpath, const struct stat *sb, int tflag,
-                        struct FTW *ftwbuf) {
+/* Entries of a new folder can be created before its watch is added, so
+   the crawl of a new folder reports every entry it finds with a synthetic
+   CREATE or CREATE_DIR event. The events are queued during the crawl and
+   printed after the event of the new folder itself. */
+
+#define SYNTHETIC_BUCKETS 1024
+
+typedef struct SyntheticPath {
+    char *fpath;
+    struct SyntheticPath *next;
+} SyntheticPath;
+
+static __thread bool crawl_synthetic = false;
+// wd of the folder at each level of the current crawl
+static __thread int *crawl_wds = NULL;
+static __thread int crawl_wds_capacity = 0;
+static __thread struct inotify_event **synthetic_events = NULL;
+static __thread int synthetic_eventc = 0;
+static __thread int synthetic_events_capacity = 0;
+/* Paths reported by synthetic events in the current call of handle_events.
+   A real event of an entry that was created while its folder was crawled
+   was queued before the crawl ended, so it is read in the same call. */
+static __thread SyntheticPath **synthetic_paths = NULL;
+static __thread int synthetic_pathc = 0;
+
+static SyntheticPath **synthetic_find(const char *fpath) {
+    if (synthetic_paths == NULL) {
+        synthetic_paths = calloc(SYNTHETIC_BUCKETS, sizeof(SyntheticPath *));
+    }
+    uint32_t hash = path_hash(fpath, strlen(fpath));
+    SyntheticPath **slot = &synthetic_paths[hash % SYNTHETIC_BUCKETS];
+    while (*slot != NULL && strcmp((*slot)->fpath, fpath) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void synthetic_clear() {
+    if (synthetic_pathc == 0) {
+        return;
+    }
+    for (int i = 0; i < SYNTHETIC_BUCKETS; i++) {
+        while (synthetic_paths[i] != NULL) {
+            SyntheticPath *path = synthetic_paths[i];
+            synthetic_paths[i] = path->next;
+            free(path->fpath);
+            free(path);
+        }
+    }
+    synthetic_pathc = 0;
+}
+
+static void synthetic_remove(SyntheticPath **slot) {
+    SyntheticPath *path = *slot;
+    *slot = path->next;
+    free(path->fpath);
+    free(path);
+    synthetic_pathc--;
+}
+
+static void queue_synthetic(int wd, const char *name, bool is_dir) {
+    if (synthetic_eventc == synthetic_events_capacity) {
+        synthetic_events_capacity =
+            synthetic_events_capacity ? synthetic_events_capacity * 2 : 64;
+        synthetic_events =
+            realloc(synthetic_events,
+                    synthetic_events_capacity * sizeof(struct inotify_event *));
+    }
+    size_t len = strlen(name) + 1;
+    struct inotify_event *event = malloc(sizeof(struct inotify_event) + len);
+    event->wd = wd;
+    event->mask = IN_CREATE | (is_dir ? IN_ISDIR : 0);
+    event->cookie = 0;
+    event->len = len;
+    memcpy(event->name, name, len);
+    synthetic_events[synthetic_eventc++] = event;
+}
+
+static void crawl_set_wd(int level, int wd) {
+    if (level >= crawl_wds_capacity) {
+        crawl_wds_capacity = level + 64;
+        crawl_wds = realloc(crawl_wds, crawl_wds_capacity * sizeof(int));
+    }
+    crawl_wds[level] = wd;
+}
+
+/* --follow-symlinks: symlinks to folders that the current walk found,
+   they are walked when it is done. */
+
+typedef struct Link {
+    char *fpath;
+    int depth;
+} Link;
+
+static __thread Link *links = NULL;
+static __thread int linkc = 0;
+// length of the symlink path the current walk resolves with "/."
+static __thread size_t crawl_link_len = 0;
+
+static void follow_link(const char *fpath, const char *name, int depth) {
+    struct stat sb;
+    if (stat(fpath, &sb) == -1 || !S_ISDIR(sb.st_mode) ||
+        is_excluded_name(name) || shard_of_path(fpath) != shard_id ||
+        mode_at_depth(depth) == -1) {
+        return;
+    }
+    ListNode *node = storage_find_by_inode(sb.st_dev, sb.st_ino);
+    if (node != NULL && storage_is_same_folder(node->fpath, node)) {
+        // already watched, the symlink is a cycle or another path to it
+        if (strcmp(node->fpath, fpath) != 0) {
+            storage_add_alias(node, fpath);
+        }
+        return;
+    }
+    links = realloc(links, (linkc + 1) * sizeof(Link));
+    links[linkc].fpath = strdup(fpath);
+    links[linkc].depth = depth;
+    linkc++;
+}
+
+static int visit(const char *fpath, const char *name, const struct stat *sb,
+                 int tflag, int level) {
+    if (crawl_synthetic && level > 0 && tflag != FTW_NS &&
+        crawl_wds[level - 1] != -1) {
+        queue_synthetic(crawl_wds[level - 1], name,
+                        tflag == FTW_D || tflag == FTW_DNR);
+    }
+    if (tflag == FTW_SL && follow_symlinks) {
+        follow_link(fpath, name, crawl_depth + level);
+    }
     if (tflag == FTW_D) {
-        if (is_excluded_name(fpath + ftwbuf->base)) {
+        if (crawl_synthetic) {
+            // entries of folders that are not watched are not reported
+            crawl_set_wd(level, -1);
+        }
+        if (is_excluded_name(name)) {
+            return FTW_SKIP_SUBTREE;
+        }
+        if (shard_of_path(fpath) != shard_id) {
+            return FTW_SKIP_SUBTREE;
+        }
+        int depth = crawl_depth + level;
+        int mode = mode_at_depth(depth);
+        if (mode != -1) {
+            ListNode *node = add_watch(fpath, sb, depth, mode);
+            if (notify_error != 0) {
+                // the subscription fails, the rest is not watched either
+                return FTW_STOP;
+            }
+            if (crawl_synthetic) {
+                crawl_set_wd(level, node ? node->wd : -1);
+            }
+            if (node != NULL && strcmp(node->fpath, fpath) != 0) {
+                // the folder is watched through another path
+                return FTW_SKIP_SUBTREE;
+            }
+        }
+        if (mode != WATCH_FULL) {
             return FTW_SKIP_SUBTREE;
         }
-        add_watch(fpath);
     }
     return FTW_CONTINUE;
 }
 
+static int visit_dirent(const char *fpath, const struct stat *sb, int tflag,
+                        struct FTW *ftwbuf) {
+    if (crawl_link_len == 0) {
+        return visit(fpath, fpath + ftwbuf->base, sb, tflag, ftwbuf->level);
+    }
+    // below a followed symlink, report the path without the "/."
+    char *logical = malloc(strlen(fpath) - 1);
+    memcpy(logical, fpath, crawl_link_len);
+    strcpy(logical + crawl_link_len, fpath + crawl_link_len + 2);
+    const char *name = logical + ftwbuf->base - 2;
+    if (ftwbuf->level == 0) {
+        const char *slash = strrchr(logical, '/');
+        name = slash ? slash + 1 : logical;
+    }
+    int action = visit(logical, name, sb, tflag, ftwbuf->level);
+    free(logical);
+    return action;
+}
+
 // TODO what happens when file is created during nftw visit
 // file can be missed?
 
-/* Walk folder recursively and setup watcher for each file */
-static void watch_recursively(const char *dir) {
+/* Walk folder recursively and setup watcher for each file, depth is the
+   level of dir below the folder it is watched from */
+static void walk(const char *dir, int depth) {
+    crawl_depth = depth;
     // fprintf(fp, "watch recursively %s\n", dir);
     int flags = FTW_PHYS | FTW_ACTIONRETVAL;
     // TODO tweak amount of descriptors to tweak performance
@@ -154,35 +571,460 @@ static void watch_recursively(const char *dir) {
     }
 }
 
-static void output_event(const struct inotify_event *event) {
-    // TODO put this after getting node
-    const char *event_string = get_event_string(event);
-    if (!event->len || !event_string) {
-        fprintf(stderr, "no event string\n");
-        // notify_print_event(event, stdout);
-        // exit(EXIT_FAILURE);
-        return;
+static void watch_recursively(const char *dir, int depth) {
+    // an earlier failure does not stop this walk
+    notify_error = 0;
+    walk(dir, depth);
+    while (linkc > 0) {
+        Link link = links[--linkc];
+        // nftw does not follow the symlink itself, "link/." is the folder
+        char *resolved;
+        join_path(&resolved, link.fpath, ".");
+        crawl_link_len = strlen(link.fpath);
+        walk(resolved, link.depth);
+        crawl_link_len = 0;
+        free(resolved);
+        free(link.fpath);
     }
+}
+
+/* Whether node is a fully watched folder below the depth limit, which is
+   only the case inside of an activated folder. */
+static bool is_beyond_depth(const ListNode *node) {
+    return max_depth >= 0 && node->depth > max_depth &&
+           node->mode == WATCH_FULL;
+}
+
+/* Watches a new folder inside of parent as deep as the depth limit allows,
+   nothing below a structure-only folder is watched. */
+static void watch_child(const ListNode *parent, const char *fpath) {
+    if (parent->mode == WATCH_FULL) {
+        crawl_full = is_beyond_depth(parent);
+        watch_recursively(fpath, parent->depth + 1);
+        crawl_full = false;
+    }
+}
+
+/* Watches a folder that has been created or moved in and reports its
+   entries with synthetic events. */
+static void watch_new_folder(const ListNode *parent, const char *fpath) {
+    crawl_synthetic = true;
+    watch_child(parent, fpath);
+    crawl_synthetic = false;
+}
+
+static void rename_watches(const char *moved_from, const char *moved_to,
+                           const ListNode *parent) {
+    if (is_excluded_folder(moved_from) && !is_excluded_folder(moved_to)) {
+        // printf("add watch yes %s\n", moved_to);
+        // storage_add
+        crawl_full = is_beyond_depth(parent);
+        int mode = mode_at_depth(parent->depth + 1);
+        crawl_full = false;
+        if (parent->mode == WATCH_FULL && mode != -1) {
+            add_watch(moved_to, NULL, parent->depth + 1, mode);
+        }
+    } else if (!is_excluded_folder(moved_from) &&
+               is_excluded_folder(moved_to)) {
+        //    printf("rm watch")
+        remove_watch_by_path(moved_from);
+    }
+
+    storage_rename(moved_from, moved_to);
+}
+
+/* Removes the watches of fpath and watches it again as its parent folder
+   would for a new folder. */
+static void rewatch(const char *fpath) {
+    remove_watch_by_path(fpath);
+    char *parent_path = strdup(fpath);
+    char *slash = strrchr(parent_path, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    }
+    int wd = slash ? storage_find_by_path(parent_path) : -1;
+    if (wd != -1) {
+        watch_child(storage_find(wd), fpath);
+    }
+    free(parent_path);
+}
+
+/* Lazy mode: remembers when a folder had its last event and activates a
+   structure-only folder when it is busy. */
+static void track_activity(const struct inotify_event *event) {
     ListNode *node = storage_find(event->wd);
-    // node can be null if there is a moved out event and
-    // then a file create event inside the moved out folder.
     if (node == NULL) {
         return;
     }
-    if (csv_needs_escape(node->fpath) || csv_needs_escape(event->name)) {
+    int now = now_seconds();
+    if (node->mode == WATCH_FULL) {
+        node->last_event = now;
+        return;
+    }
+    if (node->last_event != now) {
+        node->last_event = now;
+        node->busy = 0;
+    }
+    if (++node->busy >= LAZY_BUSY_EVENTS) {
+        crawl_full = true;
+        watch_recursively(node->fpath, node->depth);
+        crawl_full = false;
+        node->activated = 1;
+    }
+}
+
+/* Lazy mode: an activated folder without events in its subtree for
+   idle_timeout seconds goes back to a structure-only watch. */
+static void deactivate_idle() {
+    static __thread int last_check = 0;
+    int now = now_seconds();
+    if (now == last_check) {
+        return;
+    }
+    last_check = now;
+    char **idle = NULL;
+    int idlec = 0;
+    for (ListNode *a = storage_list(); a != NULL; a = a->next) {
+        if (!a->activated) {
+            continue;
+        }
+        int last_event = a->last_event;
+        for (ListNode *n = storage_list(); n != NULL; n = n->next) {
+            if (n->last_event > last_event && path_is_inside(n->fpath, a->fpath)) {
+                last_event = n->last_event;
+            }
+        }
+        if (now - last_event >= idle_timeout) {
+            idle = realloc(idle, (idlec + 1) * sizeof(char *));
+            idle[idlec++] = strdup(a->fpath);
+        }
+    }
+    for (int i = 0; i < idlec; i++) {
+        rewatch(idle[i]);
+        free(idle[i]);
+    }
+    free(idle);
+}
+
+static void read_all(int fd, void *buf, size_t count) {
+    while (count > 0) {
+        ssize_t len = read(fd, buf, count);
+        if (len == -1 && errno == EINTR) continue;
+        if (len <= 0) {
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        buf = (char *)buf + len;
+        count -= len;
+    }
+}
+
+static void print_storage() {
+    flockfile(stderr);
+    storage_print(stderr);
+    fflush(stderr);
+    funlockfile(stderr);
+}
+
+/* Sharded mode: a move between the folders of two shards is a MOVED_FROM in
+   the queue of one shard and a MOVED_TO in the queue of the other. The
+   MOVED_TO waits until the MOVED_FROM has been printed, or until every other
+   shard has handled the events queued before it, then there is none and the
+   file has been moved in from outside. When all shards wait for each other,
+   they all go on. */
+
+#define PRINTED_MOVES 256
+// shards waiting for each other give up after this
+#define MOVE_WAIT_MS 100
+
+static pthread_mutex_t moves_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t moves_cond = PTHREAD_COND_INITIALIZER;
+// cookies of the last MOVED_FROM events written to stdout
+static uint32_t printed_moves[PRINTED_MOVES];
+static int printed_movec = 0;
+// cookies of the MOVED_FROM events in the output of the shard
+static __thread uint32_t *out_moves = NULL;
+static __thread int out_movec = 0;
+
+static bool has_cookie(const uint32_t *cookies, int count, uint32_t cookie) {
+    for (int i = 0; i < count; i++) {
+        if (cookies[i] == cookie) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_printed(uint32_t cookie) {
+    int printed = printed_movec < PRINTED_MOVES ? printed_movec
+                                                 : PRINTED_MOVES;
+    return has_cookie(printed_moves, printed, cookie);
+}
+
+static void open_output() {
+    out = open_memstream(&out_buf, &out_size);
+    if (out == NULL) {
+        perror("open_memstream");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void flush_output() {
+    fclose(out);
+    out = NULL;
+    if (out_size > 0) {
+        // merge stage: the output of one shard is never interleaved with
+        // another shard, so events of one path stay in order
+        flockfile(stdout);
+        fwrite(out_buf, 1, out_size, stdout);
+        fflush(stdout);
+        funlockfile(stdout);
+    }
+    free(out_buf);
+    out_buf = NULL;
+    pthread_mutex_lock(&moves_mutex);
+    for (int i = 0; i < out_movec; i++) {
+        printed_moves[printed_movec++ % PRINTED_MOVES] = out_moves[i];
+    }
+    out_movec = 0;
+    pthread_cond_broadcast(&moves_cond);
+    pthread_mutex_unlock(&moves_mutex);
+}
+
+static void begin_output() {
+    if (shardc == 1) {
+        out = stdout;
+        return;
+    }
+    pthread_mutex_lock(&moves_mutex);
+    shards[shard_id].reading = true;
+    pthread_mutex_unlock(&moves_mutex);
+    open_output();
+}
+
+static void end_output() {
+    if (shardc == 1) {
+        fflush(stdout);
+        return;
+    }
+    flush_output();
+    pthread_mutex_lock(&moves_mutex);
+    shards[shard_id].reading = false;
+    shards[shard_id].batches++;
+    pthread_cond_broadcast(&moves_cond);
+    pthread_mutex_unlock(&moves_mutex);
+}
+
+static void emit_line(const char *fpath, const char *event_string,
+                      const char *line);
+
+/* Whether the shard has handled all events that were queued when it had
+   handled batches batches, or it cannot go on before the waiting shard. */
+static bool is_caught_up(const Shard *shard, int batches) {
+    if (shard->waiting_for != 0 && !is_printed(shard->waiting_for)) {
+        // its output so far has been printed
+        return true;
+    }
+    int queued = 0;
+    if (!shard->reading && ioctl(shard->fd, FIONREAD, &queued) == 0 &&
+        queued == 0) {
+        return true;
+    }
+    return shard->batches >= batches;
+}
+
+/* Sharded mode: waits with a MOVED_TO event until its MOVED_FROM event from
+   another shard has been printed. */
+static void wait_for_moved_from(uint32_t cookie) {
+    if (has_cookie(out_moves, out_movec, cookie)) {
+        return;
+    }
+    // the output so far goes first, another shard can wait for it
+    if (with_stat) {
+        metadata_flush(emit_line);
+    }
+    flush_output();
+    open_output();
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += MOVE_WAIT_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&moves_mutex);
+    // a batch that starts later reads everything queued by now
+    int *batches = malloc(shardc * sizeof(int));
+    for (int i = 0; i < shardc; i++) {
+        batches[i] = shards[i].batches + (shards[i].reading ? 2 : 1);
+    }
+    shards[shard_id].waiting_for = cookie;
+    pthread_cond_broadcast(&moves_cond);
+    while (!is_printed(cookie)) {
+        bool caught_up = true;
+        for (int i = 0; i < shardc && caught_up; i++) {
+            caught_up = i == shard_id || is_caught_up(&shards[i], batches[i]);
+        }
+        if (caught_up || pthread_cond_timedwait(&moves_cond, &moves_mutex,
+                                                &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    shards[shard_id].waiting_for = 0;
+    pthread_cond_broadcast(&moves_cond);
+    pthread_mutex_unlock(&moves_mutex);
+    free(batches);
+}
+
+/* Returns false when a CLOSE_WRITE event did not change the content of the
+   file, otherwise hash has the digest of the file or is empty. */
+static bool check_digest(const struct inotify_event *event, char *hash) {
+    if (!(event->mask &
+          (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+        return true;
+    }
+    char *fpath;
+    full_path(&fpath, event);
+    bool changed = true;
+    if (event->mask & IN_ISDIR) {
+        // the files below the folder are gone from this path or replaced
+        digest_forget_prefix(fpath);
+    } else if (event->mask & IN_CLOSE_WRITE) {
+        changed = digest_update(fpath, hash) != DIGEST_UNCHANGED;
+    } else {
+        // file is gone or replaced by a moved in file, a new file with the
+        // same content is a change
+        digest_forget(fpath);
+    }
+    free(fpath);
+    return changed;
+}
+
+static void print_event(FILE *stream, const char *dir,
+                        const struct inotify_event *event,
+                        const char *event_string, const char *hash) {
+    if (csv_needs_escape(dir) || csv_needs_escape(event->name)) {
         char *fpath;
         char *escaped;
-        full_path(&fpath, event);
+        join_path(&fpath, dir, event->name);
         csv_escape(&escaped, fpath);
-        fprintf(stdout, "%s,%s\n", escaped, event_string);
+        fprintf(stream, "%s,%s", escaped, event_string);
         free(escaped);
         free(fpath);
     } else {
-        fprintf(stdout, "%s/%s,%s\n", node->fpath, event->name, event_string);
+        fprintf(stream, "%s/%s,%s", dir, event->name, event_string);
         // fprintf(stdout, "%s/%s,%s,%d\n", node->fpath, event->name,
         // event_string,
         //         event->cookie);
     }
+    // the hash column is always there to keep columns fixed, it is empty
+    // for events that are not hashed
+    if (with_hash) {
+        fprintf(stream, ",%s", hash);
+    }
+}
+
+/* Writes a complete event line to stdout or to the subscribed clients. */
+static void emit_line(const char *fpath, const char *event_string,
+                      const char *line) {
+    if (serving) {
+        server_publish(fpath, event_string, line);
+    } else {
+        fprintf(out, "%s\n", line);
+    }
+}
+
+static void output_event_in(const char *dir, const struct inotify_event *event,
+                            const char *event_string, const char *hash) {
+    if (with_stat || serving) {
+        char *line;
+        size_t size;
+        FILE *stream = open_memstream(&line, &size);
+        print_event(stream, dir, event, event_string, hash);
+        fclose(stream);
+        char *fpath;
+        join_path(&fpath, dir, event->name);
+        if (with_stat) {
+            // metadata is added to the line when the read batch is complete
+            metadata_queue(fpath, event_string, line);
+            return;
+        }
+        emit_line(fpath, event_string, line);
+        free(fpath);
+        free(line);
+        return;
+    }
+    print_event(out, dir, event, event_string, hash);
+    fprintf(out, "\n");
+}
+
+static void output_event(const struct inotify_event *event) {
+    // TODO put this after getting node
+    const char *event_string = get_event_string(event);
+    if (event->mask & IN_IGNORED) {
+        // watch has been removed, nothing happened to a file
+        return;
+    }
+    if (!event->len || !event_string) {
+        fprintf(stderr, "no event string\n");
+        // notify_print_event(event, stdout);
+        // exit(EXIT_FAILURE);
+        return;
+    }
+    ListNode *node = storage_find(event->wd);
+    // node can be null if there is a moved out event and
+    // then a file create event inside the moved out folder.
+    if (node == NULL || !is_owned(node, event)) {
+        return;
+    }
+    char hash[DIGEST_HEX_LENGTH + 1] = "";
+    if (with_hash && !check_digest(event, hash)) {
+        return;
+    }
+    if (shardc > 1 && event->mask & IN_MOVED_FROM) {
+        out_moves = realloc(out_moves, (out_movec + 1) * sizeof(uint32_t));
+        out_moves[out_movec++] = event->cookie;
+    } else if (shardc > 1 && event->mask & IN_MOVED_TO) {
+        wait_for_moved_from(event->cookie);
+    }
+    output_event_in(node->fpath, event, event_string, hash);
+    // the same event below every other path of the folder
+    for (Alias *alias = storage_aliases(); alias != NULL;
+         alias = alias->next) {
+        if (!path_is_inside(node->fpath, alias->node->fpath)) {
+            continue;
+        }
+        const char *rest = node->fpath + strlen(alias->node->fpath);
+        if (*rest == '\0') {
+            output_event_in(alias->fpath, event, event_string, hash);
+            continue;
+        }
+        char *dir;
+        join_path(&dir, alias->fpath, rest + 1);
+        output_event_in(dir, event, event_string, hash);
+        free(dir);
+    }
+}
+
+/* --follow-symlinks: a symlink to a folder is watched like the folder. */
+static void adjust_link_watchers(const struct inotify_event *event) {
+    ListNode *node = storage_find(event->wd);
+    if (node == NULL || !event->len || !is_owned(node, event) ||
+        !(event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+        return;
+    }
+    char *fpath;
+    full_path(&fpath, event);
+    if (!(event->mask & IN_CREATE)) {
+        // the symlink is gone or replaced
+        remove_watch_by_path(fpath);
+    }
+    struct stat sb;
+    if (event->mask & (IN_CREATE | IN_MOVED_TO) && !is_excluded_folder(fpath) &&
+        stat(fpath, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+        watch_new_folder(node, fpath);
+    }
+    free(fpath);
 }
 
 static void adjust_watchers(const struct inotify_event *event) {
@@ -192,8 +1034,11 @@ static void adjust_watchers(const struct inotify_event *event) {
     if (moved_from) {
         // fprintf(stdout, "HAS MOVED FROM EVENT POTENTIAL RENAME\n");
         // fflush(stdout);
-        // TODO check cookie
-        if (event->mask & IN_ISDIR && event->mask & IN_MOVED_TO) {
+        // with shards the partner of a MOVED_FROM can be in another queue,
+        // the next MOVED_TO is only the same move when the cookie matches
+        if (event->mask & IN_ISDIR && event->mask & IN_MOVED_TO &&
+            event->cookie == moved_from_cookie &&
+            storage_find(event->wd) != NULL) {
             // fprintf(fp, "moved from name %s\n", moved_from);
             // fprintf(fp, "moved to name %s\n", event->name);
             // fprintf(fp, "printing events again");
@@ -207,31 +1052,27 @@ static void adjust_watchers(const struct inotify_event *event) {
             char *moved_to;
             full_path(&moved_to, event);
 
-            if (is_excluded_folder(moved_from) &&
-                !is_excluded_folder(moved_to)) {
-                // printf("add watch yes %s\n", moved_to);
-                // storage_add
-                add_watch(moved_to);
-            } else if (!is_excluded_folder(moved_from) &&
-                       is_excluded_folder(moved_to)) {
-                //    printf("rm watch")
-                remove_watch_by_path(moved_from);
+            if (shard_of_path(moved_to) == shard_id) {
+                ListNode *parent = storage_find(event->wd);
+                if (max_depth >= 0 && moved_from_wd != event->wd) {
+                    // moved to another depth, watch it like a new folder
+                    remove_watch_by_path(moved_from);
+                    if (!is_excluded_folder(moved_to)) {
+                        watch_child(parent, moved_to);
+                    }
+                } else {
+                    rename_watches(moved_from, moved_to, parent);
+                }
+                free(moved_from);
+                moved_from = 0;
+                free(moved_to);
+                // storage_print();
+                // printf("done storage rename\n");
+                // printf("new full path %s\n", fpath);
+                return;
             }
-
-            storage_rename(moved_from, moved_to);
-
-            // storage_print();
-            // fprintf(fp, "moved from %s\n", moved_from);
-            // fprintf(fp, "moved to %s\n", moved_to);
-            // printf("storage rename\n");
-            // storage_print();
-            free(moved_from);
-            moved_from = 0;
+            // moved into a top-level folder of another shard
             free(moved_to);
-            // storage_print();
-            // printf("done storage rename\n");
-            // printf("new full path %s\n", fpath);
-            return;
         }
         // moved outside -> remove watch
         // fprintf(fp, "NO RENAME, just ignored folder %s\n", fpath);
@@ -257,6 +1098,19 @@ static void adjust_watchers(const struct inotify_event *event) {
             storage_remove_by_wd(event->wd);
             return;
         }
+        if (follow_symlinks) {
+            adjust_link_watchers(event);
+        }
+        return;
+    }
+
+    ListNode *node = storage_find(event->wd);
+    if (node == NULL) {
+        // event is still queued for a folder that has already been
+        // moved out or removed
+        return;
+    }
+    if (!is_owned(node, event)) {
         return;
     }
 
@@ -266,7 +1120,7 @@ static void adjust_watchers(const struct inotify_event *event) {
         char *fpath;
         full_path(&fpath, event);
         if (!is_excluded_folder(fpath)) {
-            watch_recursively(fpath);
+            watch_new_folder(node, fpath);
         }
         free(fpath);
     }
@@ -274,6 +1128,8 @@ static void adjust_watchers(const struct inotify_event *event) {
         // fprintf(fp, "SET MOVED_FROM EVENT\n");
         // fprintf(fp, "SET MOVED_FROM EVENT NAME %s\n", event->name);
         full_path(&moved_from, event);
+        moved_from_wd = event->wd;
+        moved_from_cookie = event->cookie;
         // printf("MOVED from, from%s %d\n", moved_from->fpath,
         //        event->wd);
         // printf("%s\n", event->name);
@@ -297,6 +1153,76 @@ static void adjust_watchers(const struct inotify_event *event) {
     // }
 }
 
+/* A real create event of an entry that has already been reported by a
+   synthetic event. */
+static bool is_synthetic_duplicate(const struct inotify_event *event) {
+    if (synthetic_pathc == 0 || !(event->mask & IN_CREATE) || !event->len ||
+        storage_find(event->wd) == NULL) {
+        return false;
+    }
+    char *fpath;
+    full_path(&fpath, event);
+    SyntheticPath **slot = synthetic_find(fpath);
+    free(fpath);
+    if (*slot == NULL) {
+        return false;
+    }
+    synthetic_remove(slot);
+    return true;
+}
+
+/* An entry that is deleted or moved away can be created again in the same
+   call of handle_events, so its next create event is not a duplicate. */
+static void forget_synthetic(const struct inotify_event *event) {
+    if (synthetic_pathc == 0 || !(event->mask & (IN_DELETE | IN_MOVED_FROM)) ||
+        !event->len || storage_find(event->wd) == NULL) {
+        return;
+    }
+    char *fpath;
+    full_path(&fpath, event);
+    if (event->mask & IN_ISDIR) {
+        for (int i = 0; i < SYNTHETIC_BUCKETS; i++) {
+            SyntheticPath **slot = &synthetic_paths[i];
+            while (*slot != NULL) {
+                if (path_is_inside((*slot)->fpath, fpath)) {
+                    synthetic_remove(slot);
+                } else {
+                    slot = &(*slot)->next;
+                }
+            }
+        }
+    } else {
+        SyntheticPath **slot = synthetic_find(fpath);
+        if (*slot != NULL) {
+            synthetic_remove(slot);
+        }
+    }
+    free(fpath);
+}
+
+static void output_synthetic_events() {
+    for (int i = 0; i < synthetic_eventc; i++) {
+        struct inotify_event *event = synthetic_events[i];
+        if (storage_find(event->wd) == NULL) {
+            free(event);
+            continue;
+        }
+        char *fpath;
+        full_path(&fpath, event);
+        SyntheticPath **slot = synthetic_find(fpath);
+        if (*slot == NULL) {
+            *slot = calloc(1, sizeof(SyntheticPath));
+            (*slot)->fpath = fpath;
+            synthetic_pathc++;
+            output_event(event);
+        } else {
+            free(fpath);
+        }
+        free(event);
+    }
+    synthetic_eventc = 0;
+}
+
 /* Read all available inotify events from the file descriptor 'fd'.
           wd is the table of watch descriptors
            */
@@ -312,6 +1238,8 @@ static void handle_events(int fd) {
     const struct inotify_event *event;
     ssize_t len;
 
+    begin_output();
+
     /* Loop while events can be read from inotify file descriptor. */
 
     for (;;) {
@@ -341,13 +1269,28 @@ static void handle_events(int fd) {
             // fprintf(fp, "start___\n");
             // notify_print_event(event, fp);
             // storage_print(fp);
+            if (shardc > 1) {
+                track_owners(event);
+            }
+            forget_synthetic(event);
+            bool duplicate = is_synthetic_duplicate(event);
             adjust_watchers(event);
-            output_event(event);
+            if (!duplicate) {
+                output_event(event);
+            }
+            output_synthetic_events();
+            if (lazy) {
+                track_activity(event);
+            }
             // notify_print_event(event, fp);
             // fprintf(fp, "end___\n\n");
 
             // printf("iterate\n");
         }
+
+        if (with_stat) {
+            metadata_flush(emit_line);
+        }
     }
 
     if (moved_from) {
@@ -359,38 +1302,44 @@ static void handle_events(int fd) {
         // storage_print(fp);
         // printf("done\n");
     }
-    fflush(stdout);
+    synthetic_clear();
+    end_output();
 }
 
-void watch(const char *folder) {
-    // TODO pass exclude to global exclude
-    int poll_num;
-
-    notify_init();
-
-    fprintf(stderr, "Setting up watches. This may take a while!\n");
-    clock_t start = clock();
-
-    watch_recursively(folder);
+static void read_signal() {
+    struct signalfd_siginfo info;
+    read_all(signal_fd, &info, sizeof(info));
+}
 
-    /*Do something*/
-    clock_t end = clock();
-    float seconds = (float)(end - start) / CLOCKS_PER_SEC;
-    fprintf(stderr, "Took %f\n", seconds);
-    fprintf(stderr, "Watches established.\n");
+/* Block SIGUSR1 in all threads and receive it through signal_fd. */
+static void setup_signals() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    // storage_print();
+/* Wait for inotify events and for requests to print the storage, from
+   SIGUSR1 or, in sharded mode, from the main thread. */
+static void poll_events(int dump_fd, int sig_fd) {
+    int poll_num;
 
     /* Prepare for polling. */
 
-    nfds_t nfds = 1;
-    struct pollfd fds[] = {{fd, POLLIN}};
+    nfds_t nfds = 3;
+    struct pollfd fds[] = {{fd, POLLIN}, {dump_fd, POLLIN}, {sig_fd, POLLIN}};
 
     /* Wait for events and/or terminal input. */
 
     // printf("Listening for events.\n");
     while (1) {
-        poll_num = poll(fds, nfds, -1);
+        // lazy mode checks for idle folders every second
+        poll_num = poll(fds, nfds, lazy ? 1000 : -1);
         if (poll_num == -1) {
             if (errno == EINTR) continue;
             fprintf(stderr, "poll error\n");
@@ -404,7 +1353,95 @@ void watch(const char *folder) {
                 /* Inotify events are available. */
                 handle_events(fd);
             }
+            if (fds[1].revents & POLLIN) {
+                char request;
+                read_all(dump_fd, &request, sizeof(request));
+                print_storage();
+            }
+            if (fds[2].revents & POLLIN) {
+                read_signal();
+                print_storage();
+            }
+        }
+        if (lazy) {
+            deactivate_idle();
+        }
+    }
+}
+
+static void *run_shard(void *arg) {
+    Shard *shard = arg;
+    shard_id = shard->id;
+    notify_init();
+    shard->fd = fd;
+    watch_recursively(root, 0);
+    pthread_barrier_wait(&shards_ready);
+    poll_events(shard->dump[0], -1);
+    notify_dispose();
+    return NULL;
+}
+
+static void start_shards() {
+    shards = calloc(shardc, sizeof(Shard));
+    pthread_barrier_init(&shards_ready, NULL, shardc + 1);
+    for (int i = 0; i < shardc; i++) {
+        shards[i].id = i;
+        if (pipe(shards[i].dump) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]) !=
+            0) {
+            fprintf(stderr, "Cannot start shard %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&shards_ready);
+}
+
+void watch(const char *folder) {
+    // TODO pass exclude to global exclude
+    // without trailing slashes, root is compared with the paths in storage
+    char *fpath = strdup(folder);
+    size_t len = strlen(fpath);
+    while (len > 1 && fpath[len - 1] == '/') {
+        fpath[--len] = '\0';
+    }
+    root = fpath;
+    setup_signals();
+
+    fprintf(stderr, "Setting up watches. This may take a while!\n");
+    clock_t start = clock();
+
+    if (shardc > 1) {
+        start_shards();
+    } else {
+        notify_init();
+        watch_recursively(root, 0);
+    }
+
+    /*Do something*/
+    clock_t end = clock();
+    float seconds = (float)(end - start) / CLOCKS_PER_SEC;
+    fprintf(stderr, "Took %f\n", seconds);
+    fprintf(stderr, "Watches established.\n");
+
+    // storage_print();
+
+    if (shardc > 1) {
+        // the main thread forwards SIGUSR1 to all shards
+        while (1) {
+            read_signal();
+            for (int i = 0; i < shardc; i++) {
+                char request = 0;
+                if (write(shards[i].dump[1], &request, sizeof(request)) == -1) {
+                    perror("write");
+                    exit(EXIT_FAILURE);
+                }
+            }
         }
+    } else {
+        poll_events(-1, signal_fd);
     }
 
     printf("Listening for events stopped.\n");
@@ -413,3 +1450,109 @@ void watch(const char *folder) {
 
     notify_dispose();
 }
+
+/* Returns true when another subscribed root contains fpath. */
+static bool is_covered(const char *fpath) {
+    for (Root *r = roots; r != NULL; r = r->next) {
+        if (strcmp(r->fpath, fpath) != 0 && path_is_inside(fpath, r->fpath)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void unsubscribe_root(const char *fpath);
+
+static int subscribe_root(const char *fpath) {
+    struct stat sb;
+    if (stat(fpath, &sb) == -1 || !S_ISDIR(sb.st_mode)) {
+        return -1;
+    }
+    for (Root *r = roots; r != NULL; r = r->next) {
+        if (strcmp(r->fpath, fpath) == 0) {
+            r->refs++;
+            return 0;
+        }
+    }
+    Root *new_root = malloc(sizeof(Root));
+    new_root->fpath = strdup(fpath);
+    new_root->refs = 1;
+    new_root->next = roots;
+    roots = new_root;
+    if (!is_covered(fpath) || max_depth >= 0) {
+        // folders of nested roots are already watched and keep their wd,
+        // with a depth limit the root is watched as deep as its own limit
+        watch_recursively(fpath, 0);
+        if (notify_error != 0) {
+            // e.g. out of watches, the watches added so far are removed
+            unsubscribe_root(fpath);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void unsubscribe_root(const char *fpath) {
+    Root **slot = &roots;
+    while (*slot != NULL && strcmp((*slot)->fpath, fpath) != 0) {
+        slot = &(*slot)->next;
+    }
+    Root *r = *slot;
+    if (r == NULL || --r->refs > 0) {
+        return;
+    }
+    *slot = r->next;
+    free(r->fpath);
+    free(r);
+    if (is_covered(fpath)) {
+        if (max_depth >= 0) {
+            rewatch(fpath);
+        }
+        return;
+    }
+    remove_watch_by_path(fpath);
+    // nested roots are still subscribed
+    for (r = roots; r != NULL; r = r->next) {
+        if (path_is_inside(r->fpath, fpath) && !is_covered(r->fpath)) {
+            watch_recursively(r->fpath, 0);
+        }
+    }
+}
+
+void serve(const char *socket_path) {
+    serving = true;
+    notify_keep_running = true;
+    setup_signals();
+    notify_init();
+    server_listen(socket_path, subscribe_root, unsubscribe_root);
+    fprintf(stderr, "Listening on %s.\n", socket_path);
+
+    struct pollfd *fds = NULL;
+    while (1) {
+        nfds_t nfds = 2 + server_pollfd_count();
+        fds = realloc(fds, nfds * sizeof(struct pollfd));
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = signal_fd;
+        fds[1].events = POLLIN;
+        server_fill_pollfds(fds + 2);
+        if (poll(fds, nfds, lazy ? 1000 : -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        // before inotify events, server_flush drops clients from the poll set
+        server_handle_pollfds(fds + 2);
+        if (fds[0].revents & POLLIN) {
+            handle_events(fd);
+            server_flush();
+        }
+        if (fds[1].revents & POLLIN) {
+            read_signal();
+            print_storage();
+        }
+        if (lazy) {
+            deactivate_idle();
+        }
+    }
+}
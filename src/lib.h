@@ -1 +1,3 @@
-void watch(const char *folder);
\ No newline at end of file
+void watch(const char *folder);
+
+void serve(const char *socket_path);
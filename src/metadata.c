@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "metadata.h"
+
+#define RING_ENTRIES 64
+
+#define STATX_FIELDS (STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO)
+
+typedef struct PendingEvent {
+    char *fpath;
+    const char *event_string;
+    char *line;
+    struct statx stx;
+    int status;
+} PendingEvent;
+
+typedef struct Ring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} Ring;
+
+/* Events of the current read batch, waiting for their metadata. */
+static __thread PendingEvent *pending = NULL;
+static __thread int pendingc = 0;
+static __thread int pending_capacity = 0;
+
+static __thread Ring ring;
+// 0 = not set up yet, 1 = io_uring, -1 = synchronous statx
+static __thread int ring_state = 0;
+
+/* IORING_OP_STATX and IORING_REGISTER_PROBE both came with Linux 5.6, older
+   kernels with io_uring fail statx requests with EINVAL. */
+static bool ring_supports_statx() {
+    size_t size = sizeof(struct io_uring_probe) +
+                  (IORING_OP_STATX + 1) * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool supported =
+        syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe,
+                IORING_OP_STATX + 1) == 0 &&
+        probe->last_op >= IORING_OP_STATX &&
+        probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED;
+    free(probe);
+    return supported;
+}
+
+static void ring_setup() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring.fd == -1) {
+        // io_uring is not available (old kernel, seccomp) -> fallback
+        ring_state = -1;
+        return;
+    }
+    if (!ring_supports_statx()) {
+        close(ring.fd);
+        ring_state = -1;
+        return;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char *sq = mmap(0, sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(0, cq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED) {
+        sqes = mmap(0, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                    IORING_OFF_SQES);
+    }
+    if (sqes == MAP_FAILED) {
+        close(ring.fd);
+        ring_state = -1;
+        return;
+    }
+    ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring.sqes = sqes;
+    ring_state = 1;
+}
+
+static int ring_reap() {
+    int reaped = 0;
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        pending[cqe->user_data].status = cqe->res;
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+/* Submits statx for pending[start, end) and waits for all completions.
+   Returns -1 when io_uring cannot be used. */
+static int ring_statx(int start, int end) {
+    unsigned tail = *ring.sq_tail;
+    for (int i = start; i < end; i++) {
+        unsigned index = tail & *ring.sq_mask;
+        struct io_uring_sqe *sqe = &ring.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)pending[i].fpath;
+        sqe->len = STATX_FIELDS;
+        sqe->off = (unsigned long)&pending[i].stx;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = i;
+        ring.sq_array[index] = index;
+        tail++;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    int count = end - start;
+    int submitted = 0;
+    int completed = 0;
+    while (completed < count) {
+        int to_submit = count - submitted;
+        int ret = syscall(__NR_io_uring_enter, ring.fd, to_submit,
+                          count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        submitted += ret;
+        completed += ring_reap();
+    }
+    if (completed == count) {
+        return 0;
+    }
+    // the kernel still writes to the pending events that are in flight
+    completed += ring_reap();
+    while (completed < submitted) {
+        if (syscall(__NR_io_uring_enter, ring.fd, 0, submitted - completed,
+                    IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+            errno != EINTR) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        completed += ring_reap();
+    }
+    return -1;
+}
+
+static void stat_all() {
+    if (ring_state == 0) {
+        ring_setup();
+    }
+    if (ring_state == 1) {
+        for (int i = 0; i < pendingc; i += RING_ENTRIES) {
+            int end = i + RING_ENTRIES < pendingc ? i + RING_ENTRIES : pendingc;
+            if (ring_statx(i, end) == -1) {
+                ring_state = -1;
+                break;
+            }
+        }
+    }
+    if (ring_state == -1) {
+        for (int i = 0; i < pendingc; i++) {
+            pending[i].status =
+                statx(AT_FDCWD, pending[i].fpath, AT_SYMLINK_NOFOLLOW,
+                      STATX_FIELDS, &pending[i].stx) == -1
+                    ? -errno
+                    : 0;
+        }
+    }
+}
+
+static const char *type_string(unsigned short mode) {
+    if (S_ISREG(mode)) return "file";
+    if (S_ISDIR(mode)) return "dir";
+    if (S_ISLNK(mode)) return "symlink";
+    return "other";
+}
+
+/* Takes ownership of fpath and line. */
+void metadata_queue(char *fpath, const char *event_string, char *line) {
+    if (pendingc == pending_capacity) {
+        pending_capacity = pending_capacity ? pending_capacity * 2 : 64;
+        pending = realloc(pending, pending_capacity * sizeof(PendingEvent));
+    }
+    pending[pendingc].fpath = fpath;
+    pending[pendingc].event_string = event_string;
+    pending[pendingc].line = line;
+    pendingc++;
+}
+
+/* Stats all queued paths in one batch and emits each line followed by
+   type, size, mtime and inode. The fields are empty when the path is gone.
+   */
+void metadata_flush(void (*emit)(const char *fpath, const char *event_string,
+                                 const char *line)) {
+    if (pendingc == 0) {
+        return;
+    }
+    stat_all();
+    for (int i = 0; i < pendingc; i++) {
+        PendingEvent *event = &pending[i];
+        char *line;
+        int status;
+        if (event->status < 0) {
+            status = asprintf(&line, "%s,,,,", event->line);
+        } else {
+            status = asprintf(&line, "%s,%s,%llu,%lld.%09u,%llu", event->line,
+                              type_string(event->stx.stx_mode),
+                              (unsigned long long)event->stx.stx_size,
+                              (long long)event->stx.stx_mtime.tv_sec,
+                              event->stx.stx_mtime.tv_nsec,
+                              (unsigned long long)event->stx.stx_ino);
+        }
+        if (status == -1) {
+            perror("asprintf");
+            exit(EXIT_FAILURE);
+        }
+        emit(event->fpath, event->event_string, line);
+        free(line);
+        free(event->fpath);
+        free(event->line);
+    }
+    pendingc = 0;
+}
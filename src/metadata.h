@@ -0,0 +1,4 @@
+void metadata_queue(char *fpath, const char *event_string, char *line);
+
+void metadata_flush(void (*emit)(const char *fpath, const char *event_string,
+                                 const char *line));
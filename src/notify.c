@@ -1,11 +1,20 @@
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
 #include <unistd.h>
 
-int fd = -1;
+#include "notify.h"
+
+// one inotify instance per shard thread
+__thread int fd = -1;
+// daemon mode: a folder that cannot be watched fails the subscription of
+// one client instead of the whole process
+bool notify_keep_running = false;
+// errno of the first folder that could not be watched, notify_keep_running
+__thread int notify_error = 0;
 
 void notify_init() {
     fd = inotify_init1(IN_NONBLOCK);
@@ -22,12 +31,28 @@ void notify_dispose() {
     fd = -1;
 }
 
-int notify_add_watch(const char *fpath) {
-    int flags = IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
-                IN_CREATE | IN_DELETE | IN_ATTRIB;
+/* A structure-only watch only reports folder entries that are created,
+   deleted or moved. It never replaces a full watch of the same folder. */
+int notify_add_watch(const char *fpath, int mode) {
+    int flags = IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE;
+    if (mode == WATCH_FULL) {
+        flags |= IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB;
+    } else {
+        flags |= IN_MASK_ADD;
+    }
     int wd = inotify_add_watch(fd, fpath, flags);
     if (wd == -1) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            // folder has already been removed or replaced
+            return -1;
+        }
         fprintf(stderr, "Cannot watch '%s': %s\n", fpath, strerror(errno));
+        if (notify_keep_running) {
+            if (notify_error == 0) {
+                notify_error = errno;
+            }
+            return -1;
+        }
         exit(EXIT_FAILURE);
     }
     return wd;
@@ -36,7 +61,10 @@ int notify_add_watch(const char *fpath) {
 void notify_remove_watch(int wd) {
     int status = inotify_rm_watch(fd, wd);
     if (status == -1) {
-        printf("not ok %s %d\n", strerror(errno), wd);
+        if (errno == EINVAL) {
+            // folder has already been removed, IN_IGNORED is still queued
+            return;
+        }
         fprintf(stderr, "Cannot unwatch '%d': %s\n", wd, strerror(errno));
         fflush(stderr);
         exit(EXIT_FAILURE);
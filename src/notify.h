@@ -1,9 +1,16 @@
+#include <stdbool.h>
+
+enum { WATCH_FULL, WATCH_STRUCTURE };
+
+extern bool notify_keep_running;
+
+extern __thread int notify_error;
 
 void notify_init();
 
 void notify_dispose();
 
-int notify_add_watch(const char *fpath);
+int notify_add_watch(const char *fpath, int mode);
 
 void notify_remove_watch(int wd);
 
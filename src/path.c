@@ -0,0 +1,22 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "path.h"
+
+/* Whether fpath is folder itself or below it. */
+bool path_is_inside(const char *fpath, const char *folder) {
+    size_t len = strlen(folder);
+    return strncmp(fpath, folder, len) == 0 &&
+           (fpath[len] == '\0' || fpath[len] == '/');
+}
+
+/* FNV-1a of the first len characters of str. */
+uint32_t path_hash(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,7 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+bool path_is_inside(const char *fpath, const char *folder);
+
+uint32_t path_hash(const char *str, size_t len);
@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+// a client whose unsent events exceed this is too slow and is dropped
+#define CLIENT_BUFFER_MAX (4 * 1024 * 1024)
+// the subscription request must fit into this
+#define REQUEST_MAX (64 * 1024)
+
+/* A client subscribes by sending lines until an empty line:
+
+     root <folder>
+     event <EVENT>      (optional, repeatable, default all events)
+     exclude <name>     (optional, repeatable)
+
+   The server answers "OK" once the folder is watched, or "ERROR <reason>"
+   and closes the connection. Then every event line of the folder that
+   passes the filters is sent, in the same format as on stdout. */
+
+typedef struct Client {
+    int fd;
+    bool subscribed;
+    bool closed;
+    char *request;
+    size_t request_len;
+    char *root;
+    size_t root_len;
+    char **events;
+    int eventc;
+    char **excludes;
+    int excludec;
+    // unsent output
+    char *out;
+    size_t out_len;
+    size_t out_capacity;
+} Client;
+
+static int listen_fd = -1;
+static Client **clients = NULL;
+static int clientc = 0;
+// clients that were passed to poll, new clients are only polled next time
+static int polledc = 0;
+
+static int (*subscribe)(const char *root);
+static void (*unsubscribe)(const char *root);
+
+static void append(Client *client, const char *data, size_t len) {
+    if (client->out_len + len > client->out_capacity) {
+        size_t capacity = client->out_capacity ? client->out_capacity : 4096;
+        while (capacity < client->out_len + len) {
+            capacity *= 2;
+        }
+        client->out = realloc(client->out, capacity);
+        client->out_capacity = capacity;
+    }
+    memcpy(client->out + client->out_len, data, len);
+    client->out_len += len;
+}
+
+static void client_flush(Client *client) {
+    size_t sent = 0;
+    while (sent < client->out_len) {
+        ssize_t len = send(client->fd, client->out + sent,
+                           client->out_len - sent, MSG_NOSIGNAL);
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) {
+                // client has gone away
+                client->closed = true;
+            }
+            break;
+        }
+        sent += len;
+    }
+    memmove(client->out, client->out + sent, client->out_len - sent);
+    client->out_len -= sent;
+}
+
+static void client_fail(Client *client, const char *reason) {
+    append(client, "ERROR ", 6);
+    append(client, reason, strlen(reason));
+    append(client, "\n", 1);
+    client_flush(client);
+    client->closed = true;
+}
+
+static void add_string(char ***items, int *count, const char *value) {
+    *items = realloc(*items, (*count + 1) * sizeof(char *));
+    (*items)[(*count)++] = strdup(value);
+}
+
+static void client_subscribe(Client *client) {
+    if (client->root == NULL) {
+        client_fail(client, "missing root");
+        return;
+    }
+    char resolved[PATH_MAX];
+    if (realpath(client->root, resolved) == NULL ||
+        subscribe(resolved) == -1) {
+        client_fail(client, "cannot watch root");
+        return;
+    }
+    free(client->root);
+    client->root = strdup(resolved);
+    client->root_len = strlen(resolved);
+    // events of "/" start with "/" and not with "//"
+    if (client->root_len == 1) {
+        client->root_len = 0;
+    }
+    client->subscribed = true;
+    append(client, "OK\n", 3);
+    client_flush(client);
+}
+
+/* Handles the complete lines of the subscription request. */
+static void client_parse(Client *client) {
+    char *line = client->request;
+    char *end;
+    while (!client->subscribed && !client->closed &&
+           (end = memchr(line, '\n', client->request + client->request_len -
+                                         line)) != NULL) {
+        *end = '\0';
+        if (end > line && end[-1] == '\r') {
+            end[-1] = '\0';
+        }
+        if (*line == '\0') {
+            client_subscribe(client);
+        } else if (strncmp(line, "root ", 5) == 0 && client->root == NULL) {
+            client->root = strdup(line + 5);
+        } else if (strncmp(line, "event ", 6) == 0) {
+            add_string(&client->events, &client->eventc, line + 6);
+        } else if (strncmp(line, "exclude ", 8) == 0) {
+            add_string(&client->excludes, &client->excludec, line + 8);
+        } else {
+            client_fail(client, "invalid request");
+        }
+        line = end + 1;
+    }
+    size_t rest = client->request + client->request_len - line;
+    memmove(client->request, line, rest);
+    client->request_len = rest;
+}
+
+static void client_read(Client *client) {
+    char buf[4096];
+    for (;;) {
+        ssize_t len = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len == -1 && errno == EINTR) continue;
+        if (len == -1 && errno == EAGAIN) return;
+        if (len <= 0) {
+            client->closed = true;
+            return;
+        }
+        if (client->subscribed) {
+            // nothing is expected after the subscription
+            continue;
+        }
+        if (client->request_len + len > REQUEST_MAX) {
+            client_fail(client, "request too large");
+            return;
+        }
+        client->request = realloc(client->request, client->request_len + len);
+        memcpy(client->request + client->request_len, buf, len);
+        client->request_len += len;
+        client_parse(client);
+        if (client->closed) {
+            return;
+        }
+    }
+}
+
+static void client_free(Client *client) {
+    if (client->subscribed) {
+        unsubscribe(client->root);
+    }
+    close(client->fd);
+    for (int i = 0; i < client->eventc; i++) {
+        free(client->events[i]);
+    }
+    for (int i = 0; i < client->excludec; i++) {
+        free(client->excludes[i]);
+    }
+    free(client->events);
+    free(client->excludes);
+    free(client->request);
+    free(client->root);
+    free(client->out);
+    free(client);
+}
+
+static void remove_closed_clients() {
+    int j = 0;
+    for (int i = 0; i < clientc; i++) {
+        if (clients[i]->closed) {
+            client_free(clients[i]);
+        } else {
+            clients[j++] = clients[i];
+        }
+    }
+    clientc = j;
+}
+
+static void accept_clients() {
+    for (;;) {
+        int client_fd =
+            accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN) return;
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+        clients = realloc(clients, (clientc + 1) * sizeof(Client *));
+        Client *client = calloc(1, sizeof(Client));
+        client->fd = client_fd;
+        clients[clientc++] = client;
+    }
+}
+
+void server_listen(const char *path, int (*on_subscribe)(const char *root),
+                   void (*on_unsubscribe)(const char *root)) {
+    subscribe = on_subscribe;
+    unsubscribe = on_unsubscribe;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long: '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Socket '%s' is already in use\n", path);
+        exit(EXIT_FAILURE);
+    }
+    // socket of a previous server that is not running anymore
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "Cannot listen on '%s': %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+int server_pollfd_count() { return 1 + clientc; }
+
+void server_fill_pollfds(struct pollfd *fds) {
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for (int i = 0; i < clientc; i++) {
+        fds[i + 1].fd = clients[i]->fd;
+        fds[i + 1].events = POLLIN;
+        if (clients[i]->out_len > 0) {
+            fds[i + 1].events |= POLLOUT;
+        }
+    }
+    polledc = clientc;
+}
+
+void server_handle_pollfds(const struct pollfd *fds) {
+    for (int i = 0; i < polledc; i++) {
+        Client *client = clients[i];
+        if (fds[i + 1].revents & POLLOUT) {
+            client_flush(client);
+        }
+        if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            client_read(client);
+        }
+    }
+    remove_closed_clients();
+    if (fds[0].revents & POLLIN) {
+        accept_clients();
+    }
+}
+
+static bool has_excluded_name(const Client *client, const char *fpath) {
+    const char *name = fpath + client->root_len + 1;
+    while (*name != '\0') {
+        const char *slash = strchr(name, '/');
+        size_t len = slash ? (size_t)(slash - name) : strlen(name);
+        for (int i = 0; i < client->excludec; i++) {
+            if (strlen(client->excludes[i]) == len &&
+                memcmp(client->excludes[i], name, len) == 0) {
+                return true;
+            }
+        }
+        if (slash == NULL) {
+            break;
+        }
+        name = slash + 1;
+    }
+    return false;
+}
+
+static bool wants_event(const Client *client, const char *fpath,
+                        const char *event_string) {
+    if (!client->subscribed || client->closed ||
+        strncmp(fpath, client->root, client->root_len) != 0 ||
+        fpath[client->root_len] != '/') {
+        return false;
+    }
+    if (client->eventc > 0) {
+        bool found = false;
+        for (int i = 0; i < client->eventc && !found; i++) {
+            found = strcmp(client->events[i], event_string) == 0;
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    return !has_excluded_name(client, fpath);
+}
+
+/* Queues the event line for every client whose subscription matches. */
+void server_publish(const char *fpath, const char *event_string,
+                    const char *line) {
+    size_t len = strlen(line);
+    for (int i = 0; i < clientc; i++) {
+        Client *client = clients[i];
+        if (!wants_event(client, fpath, event_string)) {
+            continue;
+        }
+        if (client->out_len + len + 1 > CLIENT_BUFFER_MAX) {
+            fprintf(stderr, "Dropping client, it does not keep up with events\n");
+            client->closed = true;
+            continue;
+        }
+        append(client, line, len);
+        append(client, "\n", 1);
+    }
+}
+
+/* Sends queued events as far as the clients accept them, the rest is sent
+   when poll reports the client as writable. */
+void server_flush() {
+    for (int i = 0; i < clientc; i++) {
+        if (clients[i]->out_len > 0 && !clients[i]->closed) {
+            client_flush(clients[i]);
+        }
+    }
+    remove_closed_clients();
+}
@@ -0,0 +1,15 @@
+#include <poll.h>
+
+void server_listen(const char *path, int (*on_subscribe)(const char *root),
+                   void (*on_unsubscribe)(const char *root));
+
+int server_pollfd_count();
+
+void server_fill_pollfds(struct pollfd *fds);
+
+void server_handle_pollfds(const struct pollfd *fds);
+
+void server_publish(const char *fpath, const char *event_string,
+                    const char *line);
+
+void server_flush();
@@ -2,14 +2,108 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "path.h"
 
 typedef struct ListNode {
     char *fpath;
     int wd;
+    // levels below the folder the watch was activated from, --max-depth
+    short depth;
+    // WATCH_FULL or WATCH_STRUCTURE
+    char mode;
+    // activated because it was busy, deactivated when idle, --lazy
+    char activated;
+    // --lazy: events in the current second of a structure-only folder
+    int busy;
+    // --lazy: monotonic seconds of the last event
+    int last_event;
+    // the folder, one watch per folder however many paths reach it
+    dev_t dev;
+    ino_t ino;
     struct ListNode *next;
+    // next node in the same bucket of the inode index
+    struct ListNode *inode_next;
 } ListNode;
 
-static ListNode *head = NULL;
+/* Another path of a watched folder, through a symlink, a bind mount or a
+   hardlinked folder. Events of the folder and of the folders below it are
+   also reported below the alias. */
+typedef struct Alias {
+    char *fpath;
+    ListNode *node;
+    struct Alias *next;
+} Alias;
+
+// each shard thread keeps the watches of its own inotify instance
+static __thread ListNode *head = NULL;
+static __thread Alias *aliases = NULL;
+// nodes by (dev, ino), grows with the number of nodes
+static __thread ListNode **inodes = NULL;
+static __thread size_t inode_buckets = 0;
+static __thread size_t nodec = 0;
+
+static size_t inode_bucket(dev_t dev, ino_t ino) {
+    return (ino * 31 + dev) % inode_buckets;
+}
+
+static void index_add(ListNode *node) {
+    if (nodec >= inode_buckets * 2) {
+        size_t old_buckets = inode_buckets;
+        ListNode **old_inodes = inodes;
+        inode_buckets = old_buckets ? old_buckets * 4 : 1024;
+        inodes = calloc(inode_buckets, sizeof(ListNode *));
+        for (size_t i = 0; i < old_buckets; i++) {
+            ListNode *current = old_inodes[i];
+            while (current != NULL) {
+                ListNode *next = current->inode_next;
+                size_t bucket = inode_bucket(current->dev, current->ino);
+                current->inode_next = inodes[bucket];
+                inodes[bucket] = current;
+                current = next;
+            }
+        }
+        free(old_inodes);
+    }
+    size_t bucket = inode_bucket(node->dev, node->ino);
+    node->inode_next = inodes[bucket];
+    inodes[bucket] = node;
+    nodec++;
+}
+
+static void index_remove(ListNode *node) {
+    ListNode **slot = &inodes[inode_bucket(node->dev, node->ino)];
+    while (*slot != NULL && *slot != node) {
+        slot = &(*slot)->inode_next;
+    }
+    if (*slot != NULL) {
+        *slot = node->inode_next;
+        nodec--;
+    }
+}
+
+static void free_alias(Alias **slot) {
+    Alias *alias = *slot;
+    *slot = alias->next;
+    free(alias->fpath);
+    free(alias);
+}
+
+static void free_node(ListNode *node) {
+    index_remove(node);
+    Alias **slot = &aliases;
+    while (*slot != NULL) {
+        if ((*slot)->node == node) {
+            free_alias(slot);
+        } else {
+            slot = &(*slot)->next;
+        }
+    }
+    free(node->fpath);
+    free(node);
+}
 
 void storage_print(void *out) {
     ListNode *current = head;
@@ -18,6 +112,9 @@ void storage_print(void *out) {
         fprintf(out, "node: %d %s\n", current->wd, current->fpath);
         current = current->next;
     }
+    for (Alias *alias = aliases; alias != NULL; alias = alias->next) {
+        fprintf(out, "alias: %d %s\n", alias->node->wd, alias->fpath);
+    }
     fprintf(out, "\n");
 }
 
@@ -31,14 +128,17 @@ void storage_print_count() {
     printf("count: %d\n", count);
 }
 
-void storage_add(int wd, const char *fpath) {
+ListNode *storage_add(int wd, const char *fpath, dev_t dev, ino_t ino) {
     // printf("storage add %s %d\n", fpath, wd);
     // storage_print_count();
-    ListNode *new_node = (ListNode *)malloc(sizeof(ListNode));
+    ListNode *new_node = (ListNode *)calloc(1, sizeof(ListNode));
     new_node->wd = wd;
     new_node->fpath = strdup(fpath);
+    new_node->dev = dev;
+    new_node->ino = ino;
     new_node->next = head;
     head = new_node;
+    index_add(new_node);
 
     // fprintf(stdout, "%d\n", new_node);
     // fprintf(stdout, "size: %d\n", sizeof(ListNode));
@@ -47,6 +147,14 @@ void storage_add(int wd, const char *fpath) {
     // current = next;
 
     // storage_print(stdout);
+    return new_node;
+}
+
+ListNode *storage_list() { return head; }
+
+void storage_update(ListNode *node, const char *fpath) {
+    free(node->fpath);
+    node->fpath = strdup(fpath);
 }
 
 ListNode *storage_find(int wd) {
@@ -60,6 +168,54 @@ ListNode *storage_find(int wd) {
     return NULL;
 }
 
+ListNode *storage_find_by_inode(dev_t dev, ino_t ino) {
+    if (inodes == NULL) {
+        return NULL;
+    }
+    ListNode *node = inodes[inode_bucket(dev, ino)];
+    while (node != NULL && (node->dev != dev || node->ino != ino)) {
+        node = node->inode_next;
+    }
+    return node;
+}
+
+void storage_add_alias(ListNode *node, const char *fpath) {
+    for (Alias *alias = aliases; alias != NULL; alias = alias->next) {
+        if (alias->node == node && strcmp(alias->fpath, fpath) == 0) {
+            return;
+        }
+    }
+    Alias *alias = malloc(sizeof(Alias));
+    alias->fpath = strdup(fpath);
+    alias->node = node;
+    alias->next = aliases;
+    aliases = alias;
+}
+
+Alias *storage_aliases() { return aliases; }
+
+/* Whether fpath still leads to the folder of node. */
+bool storage_is_same_folder(const char *fpath, const ListNode *node) {
+    struct stat sb;
+    return stat(fpath, &sb) == 0 && sb.st_dev == node->dev &&
+           sb.st_ino == node->ino;
+}
+
+/* Replaces the prefix moved_from of *fpath with moved_to. */
+static void rename_path(char **fpath, const char *moved_from, int len_from,
+                        const char *moved_to, int len_to) {
+    if (len_from == len_to) {
+        memcpy(*fpath, moved_to, len_from);
+        return;
+    }
+    int count = strlen(*fpath) + len_to - len_from + 1;
+    char *oldPath = *fpath;
+    *fpath = malloc(count);
+    memcpy(*fpath, moved_to, len_to);
+    memcpy(*fpath + len_to, oldPath + len_from, count - len_to);
+    free(oldPath);
+}
+
 void storage_rename(const char *moved_from, const char *moved_to) {
     // printf("node check %s %s\n", moved_from, moved_to);
     ListNode *node = head;
@@ -80,18 +236,8 @@ void storage_rename(const char *moved_from, const char *moved_to) {
         // int len_node = strlen(node->fpath);
         // printf("check %s\n", node);
         // fflush(stdout);
-        if (strncmp(moved_from, node->fpath, len_from) == 0) {
-            if (len_from == len_to) {
-                memcpy(node->fpath, moved_to, len_from);
-            } else {
-                int count = strlen(node->fpath) + len_to - len_from + 1;
-                char *oldPath = node->fpath;
-                node->fpath = malloc(count);
-                memcpy(node->fpath, moved_to, len_to);
-                memcpy(node->fpath + len_to, oldPath + len_from,
-                       count - len_to);
-                free(oldPath);
-            }
+        if (path_is_inside(node->fpath, moved_from)) {
+            rename_path(&node->fpath, moved_from, len_from, moved_to, len_to);
             // found = true;
             // // char *new_name;
             // // asprintf
@@ -100,6 +246,23 @@ void storage_rename(const char *moved_from, const char *moved_to) {
         }
         node = node->next;
     }
+    for (Alias *alias = aliases; alias != NULL; alias = alias->next) {
+        if (path_is_inside(alias->fpath, moved_from)) {
+            rename_path(&alias->fpath, moved_from, len_from, moved_to, len_to);
+        }
+    }
+    // a symlink does not follow the folder it points to
+    Alias **slot = &aliases;
+    while (*slot != NULL) {
+        Alias *alias = *slot;
+        if ((path_is_inside(alias->node->fpath, moved_to) ||
+             path_is_inside(alias->fpath, moved_to)) &&
+            !storage_is_same_folder(alias->fpath, alias->node)) {
+            free_alias(slot);
+        } else {
+            slot = &alias->next;
+        }
+    }
     // storage_print(stdout);
 }
 
@@ -118,8 +281,7 @@ void storage_remove_by_wd(int wd) {
             }
             // fprintf(stdout, "found node\n");
             // fflush(stdout);
-            free(node->fpath);
-            free(node);
+            free_node(node);
             return;
         }
         prev = node;
@@ -143,25 +305,62 @@ int storage_find_by_path(const char *fpath) {
     return -1;
 }
 
+/* Folders below fpath that can still be reached through an alias outside
+   of fpath move to that alias instead of being removed, other aliases of
+   them are removed. */
+static void promote_aliases(const char *fpath) {
+    Alias **slot = &aliases;
+    while (*slot != NULL) {
+        if (path_is_inside((*slot)->fpath, fpath)) {
+            free_alias(slot);
+        } else {
+            slot = &(*slot)->next;
+        }
+    }
+    slot = &aliases;
+    while (*slot != NULL) {
+        Alias *alias = *slot;
+        if (!path_is_inside(alias->node->fpath, fpath)) {
+            slot = &alias->next;
+            continue;
+        }
+        if (!storage_is_same_folder(alias->fpath, alias->node)) {
+            // the folder has been moved away from the alias as well
+            free_alias(slot);
+            continue;
+        }
+        *slot = alias->next;
+        char *moved_from = strdup(alias->node->fpath);
+        storage_rename(moved_from, alias->fpath);
+        free(moved_from);
+        free(alias->fpath);
+        free(alias);
+        // the rename changed the aliases below the promoted folder
+        slot = &aliases;
+    }
+}
+
 void storage_find_and_remove_by_path(const char *fpath, void (*cb)(int wd)) {
+    promote_aliases(fpath);
     ListNode *prev = head;
     ListNode *node = head;
-    int len = strlen(fpath);
     while (node != NULL) {
         // fprintf(stdout, "compare %s with %s\n", fpath, node->fpath);
-        if (strncmp(node->fpath, fpath, len) == 0 &&
-            (strlen(node->fpath) == len || node->fpath[len] == '/')) {
+        if (path_is_inside(node->fpath, fpath)) {
             int wd = node->wd;
             // fprintf(stdout, "found wd %d\n", wd);
             // fflush(stdout);
             cb(wd);
+            ListNode *next = node->next;
             if (node == head) {
-                head = node->next;
+                head = next;
             } else {
-                prev->next = node->next;
+                prev->next = next;
             }
-            free(node->fpath);
-            free(node);
+            free_node(node);
+            // prev stays the same, it is still in front of next
+            node = next;
+            continue;
         }
         prev = node;
         node = node->next;
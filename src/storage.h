@@ -1,17 +1,56 @@
+#include <stdbool.h>
+#include <sys/types.h>
+
 typedef struct ListNode {
     char *fpath;
     int wd;
+    // levels below the folder the watch was activated from, --max-depth
+    short depth;
+    // WATCH_FULL or WATCH_STRUCTURE
+    char mode;
+    // activated because it was busy, deactivated when idle, --lazy
+    char activated;
+    // --lazy: events in the current second of a structure-only folder
+    int busy;
+    // --lazy: monotonic seconds of the last event
+    int last_event;
+    // the folder, one watch per folder however many paths reach it
+    dev_t dev;
+    ino_t ino;
     struct ListNode *next;
+    // next node in the same bucket of the inode index
+    struct ListNode *inode_next;
 } ListNode;
 
+/* Another path of a watched folder, through a symlink, a bind mount or a
+   hardlinked folder. Events of the folder and of the folders below it are
+   also reported below the alias. */
+typedef struct Alias {
+    char *fpath;
+    ListNode *node;
+    struct Alias *next;
+} Alias;
+
 void storage_print(void *out);
 
 void storage_print_count();
 
-void storage_add(int wd, const char *fpath);
+ListNode *storage_add(int wd, const char *fpath, dev_t dev, ino_t ino);
+
+ListNode *storage_list();
+
+void storage_update(ListNode *node, const char *fpath);
 
 ListNode *storage_find(int wd);
 
+ListNode *storage_find_by_inode(dev_t dev, ino_t ino);
+
+void storage_add_alias(ListNode *node, const char *fpath);
+
+Alias *storage_aliases();
+
+bool storage_is_same_folder(const char *fpath, const ListNode *node);
+
 void storage_remove_by_wd(int wd);
 
 int storage_find_by_path(const char *fpath);
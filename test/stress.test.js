@@ -0,0 +1,21 @@
+import { runStress } from "../benchmark/stress.js";
+
+const expectAccurate = (result) => {
+  expect(result.crashed).toBe(null);
+  expect(result.missed).toEqual([]);
+  expect(result.spurious).toEqual([]);
+  expect(result.stale).toEqual([]);
+  expect(result.misordered).toEqual([]);
+  expect(result.leakedWatches).toEqual([]);
+  expect(result.missingWatches).toEqual([]);
+};
+
+test("stress - random operations at low rate", async () => {
+  const result = await runStress({ seed: 1, ops: 400, rate: 50 });
+  expectAccurate(result);
+}, 60_000);
+
+test("stress - random operations at low rate with shards", async () => {
+  const result = await runStress({ seed: 2, ops: 400, rate: 50, shards: 4 });
+  expectAccurate(result);
+}, 60_000);
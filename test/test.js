@@ -1,4 +1,5 @@
 import { spawn } from "node:child_process";
+import { createConnection } from "node:net";
 import csv from "csv-parser";
 import { execa } from "execa";
 import {
@@ -14,7 +15,9 @@ import {
 } from "node:fs/promises";
 import { tmpdir } from "node:os";
 import { join } from "node:path";
+import { setTimeout } from "node:timers/promises";
 import waitForExpect from "wait-for-expect";
+import { shardOf } from "../benchmark/stress.js";
 
 const exec = async (file, args) => {
   await execa(file, args);
@@ -70,6 +73,12 @@ const createWatcher = async (args = []) => {
     clear() {
       result = "";
     },
+    pause() {
+      child.kill("SIGSTOP");
+    },
+    resume() {
+      child.kill("SIGCONT");
+    },
     get status() {
       return status;
     },
@@ -136,6 +145,79 @@ const createCsvWatcher = async (args = []) => {
   };
 };
 
+/**
+ *
+ * @param {string} socketPath
+ * @param {number} [maxWatches] limit of inotify watches, in a user namespace
+ */
+const createDaemon = async (socketPath, maxWatches) => {
+  const child =
+    maxWatches === undefined
+      ? spawn("./hello", ["--socket", socketPath])
+      : spawn("unshare", [
+          "--user",
+          "--map-root-user",
+          "sh",
+          "-c",
+          `echo ${maxWatches} > /proc/sys/user/max_inotify_watches && exec ./hello --socket ${socketPath}`,
+        ]);
+  let stderr = "";
+  await new Promise((resolve) => {
+    child.stderr.on("data", (data) => {
+      stderr += data.toString();
+      if (stderr.includes("Listening on")) {
+        resolve(undefined);
+      }
+    });
+  });
+  return {
+    get stderr() {
+      return stderr;
+    },
+    printStorage() {
+      child.kill("SIGUSR1");
+    },
+    dispose() {
+      child.kill();
+    },
+  };
+};
+
+/**
+ *
+ * @param {string} socketPath
+ * @param {readonly string[]} request
+ */
+const createClient = async (socketPath, request) => {
+  const socket = createConnection(socketPath);
+  let result = "";
+  socket.on("data", (data) => {
+    result += data.toString();
+  });
+  socket.write(`${request.join("\n")}\n\n`);
+  await new Promise((resolve) => {
+    socket.on("data", () => {
+      if (result.includes("\n")) {
+        resolve(undefined);
+      }
+    });
+  });
+  const [reply] = result.split("\n", 1);
+  result = result.slice(reply.length + 1);
+  return {
+    reply,
+    get stdout() {
+      return result;
+    },
+    clear() {
+      result = "";
+    },
+    dispose() {
+      socket.destroy();
+    },
+  };
+};
+
 beforeAll(() => {
   waitForExpect.defaults.timeout = 101;
 });
@@ -857,6 +939,7 @@ test("move out folder and move it back in", async () => {
   await waitForExpect(() => {
     expect(watcher.stdout).toBe(`${tmpDir}/1,MOVED_FROM_DIR
 ${tmpDir}/1,MOVED_TO_DIR
+${tmpDir}/1/a.txt,CREATE
 ${tmpDir}/b.txt,CREATE
 ${tmpDir}/b.txt,CLOSE_WRITE
 `);
@@ -1063,6 +1146,84 @@ ${tmpDir}/2,MOVED_TO_DIR
   watcher.dispose();
 });
 
+test("move in folder with files", async () => {
+  const tmpDir = await getTmpDir();
+  const tmpDir2 = await getTmpDir();
+  await mkdir(`${tmpDir2}/1/2`, { recursive: true });
+  await writeFile(`${tmpDir2}/1/2/a.txt`, "");
+  const watcher = await createWatcher([tmpDir]);
+  await rename(`${tmpDir2}/1`, `${tmpDir}/1`);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/1,MOVED_TO_DIR
+${tmpDir}/1/2,CREATE_DIR
+${tmpDir}/1/2/a.txt,CREATE
+`);
+  });
+  watcher.dispose();
+});
+
+test("create nested folders and a file at once", async () => {
+  const tmpDir = await getTmpDir();
+  const watcher = await createWatcher([tmpDir]);
+  for (let i = 0; i < 10; i++) {
+    await mkdir(`${tmpDir}/${i}/a/b`, { recursive: true });
+    await writeFile(`${tmpDir}/${i}/a/b/c.txt`, "");
+  }
+  await waitForExpect(() => {
+    expect(watcher.stdout.split("\n").filter(Boolean).sort()).toEqual(
+      [...Array(10).keys()]
+        .flatMap((i) => [
+          `${tmpDir}/${i},CREATE_DIR`,
+          `${tmpDir}/${i}/a,CREATE_DIR`,
+          `${tmpDir}/${i}/a/b,CREATE_DIR`,
+          `${tmpDir}/${i}/a/b/c.txt,CREATE`,
+          `${tmpDir}/${i}/a/b/c.txt,CLOSE_WRITE`,
+        ])
+        .sort()
+    );
+  });
+  watcher.dispose();
+});
+
+test("move in folder, then delete and recreate files in it", async () => {
+  const tmpDir = await getTmpDir();
+  const tmpDir2 = await getTmpDir();
+  const files = [...Array(20).keys()].map((i) => `f${i}`);
+  // many folders to slow down the crawl of the moved in folder
+  await Promise.all(
+    [...Array(5000).keys()].map((i) =>
+      mkdir(`${tmpDir2}/m/big/${i}`, { recursive: true })
+    )
+  );
+  await Promise.all(files.map((file) => writeFile(`${tmpDir2}/m/${file}`, "")));
+  const watcher = await createWatcher([tmpDir]);
+  await rename(`${tmpDir2}/m`, `${tmpDir}/m`);
+  // let the crawl start
+  await setTimeout(5);
+  for (const file of files) {
+    await rm(`${tmpDir}/m/${file}`);
+    await writeFile(`${tmpDir}/m/${file}`, "");
+  }
+  await writeFile(`${tmpDir}/done`, "");
+  // the synthetic events of the big folder take a while
+  await waitForExpect(() => {
+    expect(watcher.stdout).toContain(`${tmpDir}/done,CLOSE_WRITE`);
+  }, 5_000);
+  // the crawl can see a file before or after it is deleted, but the last
+  // create must not be dropped
+  for (const file of files) {
+    const lines = watcher.stdout
+      .split("\n")
+      .filter(
+        (line) =>
+          line === `${tmpDir}/m/${file},CREATE` ||
+          line === `${tmpDir}/m/${file},DELETE`
+      );
+    expect(lines.at(-1)).toBe(`${tmpDir}/m/${file},CREATE`);
+  }
+  watcher.dispose();
+}, 20_000);
+
 test("move in nested folder", async () => {
   const tmpDir = await getTmpDir();
   const tmpDir2 = await getTmpDir();
@@ -1071,6 +1232,14 @@ test("move in nested folder", async () => {
   await rename(`${tmpDir2}/1`, `${tmpDir}/1`);
   await waitForExpect(() => {
     expect(watcher.stdout).toBe(`${tmpDir}/1,MOVED_TO_DIR
+${tmpDir}/1/2,CREATE_DIR
+${tmpDir}/1/2/3,CREATE_DIR
+${tmpDir}/1/2/3/4,CREATE_DIR
+${tmpDir}/1/2/3/4/5,CREATE_DIR
+${tmpDir}/1/2/3/4/5/6,CREATE_DIR
+${tmpDir}/1/2/3/4/5/6/7,CREATE_DIR
+${tmpDir}/1/2/3/4/5/6/7/8,CREATE_DIR
+${tmpDir}/1/2/3/4/5/6/7/8/9,CREATE_DIR
 `);
   });
   watcher.clear();
@@ -1899,28 +2068,60 @@ ${tmpDir}/d/1.txt,CLOSE_WRITE
   watcher.dispose();
 });
 
-// TODO test is failing in ci sometimes https://github.com/levivilet/c-watcher/runs/4059024632?check_suite_focus=true
-test.skip("symlinked file", async () => {
+test("shards - create files in many folders", async () => {
   const tmpDir = await getTmpDir();
-  await writeFile(`${tmpDir}/a.txt`, "");
-  await symlink(`${tmpDir}/a.txt`, `${tmpDir}/b.txt`);
-  const watcher = await createWatcher([tmpDir]);
-  await writeFile(`${tmpDir}/a.txt`, "aaa");
+  const names = ["a", "b", "c", "d", "e", "f", "g", "h"];
+  await Promise.all(names.map((name) => mkdir(`${tmpDir}/${name}/1`, { recursive: true })));
+  const watcher = await createWatcher([tmpDir, "--shards", "4"]);
+  await Promise.all(names.map((name) => writeFile(`${tmpDir}/${name}/1/1.txt`, "")));
   await waitForExpect(() => {
-    expect(watcher.stdout).toBe(`${tmpDir}/a.txt,MODIFY
-${tmpDir}/a.txt,MODIFY
-${tmpDir}/a.txt,CLOSE_WRITE
-`);
+    expect(watcher.stdout.split("\n").sort()).toEqual([
+      "",
+      ...names.flatMap((name) => [
+        `${tmpDir}/${name}/1/1.txt,CLOSE_WRITE`,
+        `${tmpDir}/${name}/1/1.txt,CREATE`,
+      ]),
+    ]);
   });
+  for (const name of names) {
+    const lines = watcher.stdout.split("\n");
+    expect(lines.indexOf(`${tmpDir}/${name}/1/1.txt,CREATE`)).toBeLessThan(
+      lines.indexOf(`${tmpDir}/${name}/1/1.txt,CLOSE_WRITE`)
+    );
+  }
   watcher.dispose();
 });
 
-test("symlinked folder", async () => {
+test("shards - move folder between top-level folders", async () => {
   const tmpDir = await getTmpDir();
-  await mkdir(`${tmpDir}/a`);
-  await symlink(`${tmpDir}/a`, `${tmpDir}/b`);
-  const watcher = await createWatcher([tmpDir]);
-  await writeFile(`${tmpDir}/b/1.txt`, "");
+  const names = ["a", "b", "c", "d", "e", "f", "g", "h"];
+  await Promise.all(names.map((name) => mkdir(`${tmpDir}/${name}`)));
+  await mkdir(`${tmpDir}/a/1/2`, { recursive: true });
+  const watcher = await createWatcher([tmpDir, "--shards", "4"]);
+  for (let i = 1; i < names.length; i++) {
+    await rename(`${tmpDir}/${names[i - 1]}/1`, `${tmpDir}/${names[i]}/1`);
+    const expected = [
+      "",
+      `${tmpDir}/${names[i - 1]}/1,MOVED_FROM_DIR`,
+      `${tmpDir}/${names[i]}/1,MOVED_TO_DIR`,
+    ];
+    if (shardOf(names[i - 1], 4) !== shardOf(names[i], 4)) {
+      // new folder for the other shard
+      expected.push(`${tmpDir}/${names[i]}/1/2,CREATE_DIR`);
+    }
+    await waitForExpect(() => {
+      expect(watcher.stdout.split("\n")).toEqual([...expected.slice(1), ""]);
+    });
+    watcher.clear();
+  }
+  await writeFile(`${tmpDir}/h/1/2/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/h/1/2/1.txt,CREATE
+${tmpDir}/h/1/2/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/a/1.txt`, "");
   await waitForExpect(() => {
     expect(watcher.stdout).toBe(`${tmpDir}/a/1.txt,CREATE
 ${tmpDir}/a/1.txt,CLOSE_WRITE
@@ -1929,110 +2130,990 @@ ${tmpDir}/a/1.txt,CLOSE_WRITE
   watcher.dispose();
 });
 
-// TODO test hardlink
+test("shards - moves between shards in one batch", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a/x`, { recursive: true });
+  await mkdir(`${tmpDir}/b/y`, { recursive: true });
+  await mkdir(`${tmpDir}/c`);
+  const watcher = await createWatcher([tmpDir, "--shards", "2"]);
+  // a and c have the same shard, b has the other one
+  watcher.pause();
+  await rename(`${tmpDir}/a/x`, `${tmpDir}/b/x`);
+  await rename(`${tmpDir}/b/y`, `${tmpDir}/c/y`);
+  watcher.resume();
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a/x,MOVED_FROM_DIR
+${tmpDir}/b/x,MOVED_TO_DIR
+${tmpDir}/b/y,MOVED_FROM_DIR
+${tmpDir}/c/y,MOVED_TO_DIR
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/b/x/f.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/b/x/f.txt,CREATE
+${tmpDir}/b/x/f.txt,CLOSE_WRITE
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/c/y/g.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/c/y/g.txt,CREATE
+${tmpDir}/c/y/g.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
 
-test.skip("delete watched folder", async () => {
+test("shards - rename top-level folder", async () => {
   const tmpDir = await getTmpDir();
-  const watcher = await createWatcher([tmpDir]);
-  await rm(tmpDir, { recursive: true });
+  await mkdir(`${tmpDir}/a/b/c`, { recursive: true });
+  const watcher = await createWatcher([tmpDir, "--shards", "4"]);
+  // a, f2 and c have different shards, the folder stays with the shard of a
+  await rename(`${tmpDir}/a`, `${tmpDir}/f2`);
   await waitForExpect(() => {
-    expect(watcher.stdout).toBe(``);
-    expect(watcher.status).toBe("normal");
+    expect(watcher.stdout).toBe(`${tmpDir}/a,MOVED_FROM_DIR
+${tmpDir}/f2,MOVED_TO_DIR
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/f2/b/c/g.txt`, "");
+  await rename(`${tmpDir}/f2`, `${tmpDir}/c`);
+  await writeFile(`${tmpDir}/c/b/h.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/f2/b/c/g.txt,CREATE
+${tmpDir}/f2/b/c/g.txt,CLOSE_WRITE
+${tmpDir}/f2,MOVED_FROM_DIR
+${tmpDir}/c,MOVED_TO_DIR
+${tmpDir}/c/b/h.txt,CREATE
+${tmpDir}/c/b/h.txt,CLOSE_WRITE
+`);
+  });
+  watcher.clear();
+  await mkdir(`${tmpDir}/a`);
+  await writeFile(`${tmpDir}/a/i.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a,CREATE_DIR
+${tmpDir}/a/i.txt,CREATE
+${tmpDir}/a/i.txt,CLOSE_WRITE
+`);
   });
   watcher.dispose();
 });
 
-test("cli help", async () => {
-  const watcher = await createCliWatcher(["--help"]);
+test("shards - rename top-level file", async () => {
+  const tmpDir = await getTmpDir();
+  await writeFile(`${tmpDir}/x.txt`, "");
+  const watcher = await createWatcher([tmpDir, "--shards", "4"]);
+  await rename(`${tmpDir}/x.txt`, `${tmpDir}/y.txt`);
+  await appendFile(`${tmpDir}/y.txt`, "a");
   await waitForExpect(() => {
-    expect(watcher.stdout.split("\n")).toEqual([
-      expect.stringMatching(/hello \d+\.\d+\.\d+/),
-      "Recursively watch a folder for changes",
-      "Usage: hello [ options ] sample-folder",
-      "Options:",
-      "\t-h|--help     \tShow this help text.",
-      "\t--exclude <name>",
-      "\t              \tExclude all events on files matching <name>",
-      "",
-    ]);
+    expect(watcher.stdout).toBe(`${tmpDir}/x.txt,MOVED_FROM
+${tmpDir}/y.txt,MOVED_TO
+${tmpDir}/y.txt,MODIFY
+${tmpDir}/y.txt,CLOSE_WRITE
+`);
   });
   watcher.dispose();
 });
 
-test("cli version", async () => {
-  const watcher = await createCliWatcher(["--version"]);
+test("shards - move out top-level folder", async () => {
+  const tmpDir = await getTmpDir();
+  const tmpDir2 = await getTmpDir();
+  await mkdir(`${tmpDir}/a/b`, { recursive: true });
+  const watcher = await createWatcher([tmpDir, "--shards", "4"]);
+  await rename(`${tmpDir}/a`, `${tmpDir2}/a`);
+  await writeFile(`${tmpDir2}/a/b/1.txt`, "");
+  await writeFile(`${tmpDir}/2.txt`, "");
   await waitForExpect(() => {
-    expect(watcher.stdout).toMatch(/hello \d+\.\d+\.\d+/);
+    expect(watcher.stdout.split("\n").sort()).toEqual([
+      "",
+      `${tmpDir}/2.txt,CLOSE_WRITE`,
+      `${tmpDir}/2.txt,CREATE`,
+      `${tmpDir}/a,MOVED_FROM_DIR`,
+    ]);
   });
   watcher.dispose();
 });
 
-test("cli missing arguments", async () => {
-  const watcher = await createCliWatcher([]);
+test("shards - root folder with trailing slash", async () => {
+  const tmpDir = await getTmpDir();
+  const watcher = await createWatcher([`${tmpDir}/`, "--shards", "3"]);
+  await writeFile(`${tmpDir}/1.txt`, "");
+  await mkdir(`${tmpDir}/a`);
+  const expected = `${tmpDir}/1.txt,CREATE
+${tmpDir}/1.txt,CLOSE_WRITE
+${tmpDir}/a,CREATE_DIR
+`;
   await waitForExpect(() => {
-    expect(watcher.stderr).toBe(`No files specified to watch!
+    expect(watcher.stdout).toBe(expected);
+  });
+  // no shard but the owner reports the events
+  await setTimeout(50);
+  expect(watcher.stdout).toBe(expected);
+  watcher.clear();
+  await writeFile(`${tmpDir}/a/2.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a/2.txt,CREATE
+${tmpDir}/a/2.txt,CLOSE_WRITE
 `);
   });
   watcher.dispose();
 });
 
-test("cli invalid option", async () => {
-  const watcher = await createCliWatcher(["--exclude   "]);
+test("hash - skip close write when content did not change", async () => {
+  const tmpDir = await getTmpDir();
+  await writeFile(`${tmpDir}/a.txt`, "abc");
+  const watcher = await createWatcher([tmpDir, "--hash"]);
+  await appendFile(`${tmpDir}/a.txt`, "");
   await waitForExpect(() => {
-    expect(watcher.stdout).toBe(`Usage: hello [ options ] sample-folder
+    expect(watcher.stdout).toBe(`${tmpDir}/a.txt,CLOSE_WRITE,44bc2cf5ad770999
+`);
+  });
+  watcher.clear();
+  await appendFile(`${tmpDir}/a.txt`, "");
+  // events are handled in order, so the CLOSE_WRITE above has been hashed
+  await mkdir(`${tmpDir}/b`);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/b,CREATE_DIR,
+`);
+  });
+  watcher.clear();
+  await appendFile(`${tmpDir}/a.txt`, "d");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a.txt,MODIFY,
+${tmpDir}/a.txt,CLOSE_WRITE,de0327b0d25d92cc
 `);
   });
   watcher.dispose();
 });
 
-test("cli unknown option", async () => {
-  const watcher = await createCliWatcher(["-k"]);
+test("hash - emit close write after file is recreated", async () => {
+  const tmpDir = await getTmpDir();
+  const watcher = await createWatcher([tmpDir, "--hash"]);
+  await writeFile(`${tmpDir}/a.txt`, "");
+  await rm(`${tmpDir}/a.txt`);
+  await writeFile(`${tmpDir}/a.txt`, "");
   await waitForExpect(() => {
-    expect(watcher.stdout).toBe(`Usage: hello [ options ] sample-folder
+    expect(watcher.stdout).toBe(`${tmpDir}/a.txt,CREATE,
+${tmpDir}/a.txt,CLOSE_WRITE,ef46db3751d8e999
+${tmpDir}/a.txt,DELETE,
+${tmpDir}/a.txt,CREATE,
+${tmpDir}/a.txt,CLOSE_WRITE,ef46db3751d8e999
 `);
   });
   watcher.dispose();
 });
 
-// TODO move folder inside out
+test("hash - emit close write after file is replaced by rename", async () => {
+  const tmpDir = await getTmpDir();
+  const watcher = await createWatcher([tmpDir, "--hash"]);
+  await writeFile(`${tmpDir}/a.txt`, "abc");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toContain(`${tmpDir}/a.txt,CLOSE_WRITE,`);
+  });
+  await writeFile(`${tmpDir}/tmp.txt`, "abcd");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toContain(`${tmpDir}/tmp.txt,CLOSE_WRITE,`);
+  });
+  watcher.clear();
+  // atomic save, a.txt has new content without a CLOSE_WRITE of its own
+  await rename(`${tmpDir}/tmp.txt`, `${tmpDir}/a.txt`);
+  await writeFile(`${tmpDir}/a.txt`, "abc");
+  await waitForExpect(() => {
+    // truncating and writing are one or two MODIFY events
+    const lines = watcher.stdout.split("\n");
+    expect(lines.filter((line) => !line.endsWith(",MODIFY,"))).toEqual([
+      `${tmpDir}/tmp.txt,MOVED_FROM,`,
+      `${tmpDir}/a.txt,MOVED_TO,`,
+      `${tmpDir}/a.txt,CLOSE_WRITE,44bc2cf5ad770999`,
+      "",
+    ]);
+  });
+  watcher.dispose();
+});
 
-test("rename when moved_to folder name is longer than moved_from", async () => {
+test("hash - emit close write after folder is renamed and recreated", async () => {
   const tmpDir = await getTmpDir();
-  await mkdir(`${tmpDir}/a/b/c`, { recursive: true });
-  await mkdir(`${tmpDir}/f`);
-  const watcher = await createWatcher([tmpDir]);
-  await rename(`${tmpDir}/a`, `${tmpDir}/f2`);
+  await mkdir(`${tmpDir}/d`);
+  await writeFile(`${tmpDir}/d/a.txt`, "");
+  const watcher = await createWatcher([tmpDir, "--hash"]);
+  await appendFile(`${tmpDir}/d/a.txt`, "");
   await waitForExpect(() => {
-    expect(watcher.stdout).toBe(`${tmpDir}/a,MOVED_FROM_DIR
-${tmpDir}/f2,MOVED_TO_DIR
+    expect(watcher.stdout).toBe(`${tmpDir}/d/a.txt,CLOSE_WRITE,ef46db3751d8e999
 `);
   });
   watcher.clear();
-  await writeFile(`${tmpDir}/f2/g.txt`, "");
+  await rename(`${tmpDir}/d`, `${tmpDir}/e`);
+  await mkdir(`${tmpDir}/d`);
   await waitForExpect(() => {
-    expect(watcher.stdout).toBe(`${tmpDir}/f2/g.txt,CREATE
-${tmpDir}/f2/g.txt,CLOSE_WRITE
+    expect(watcher.stdout).toBe(`${tmpDir}/d,MOVED_FROM_DIR,
+${tmpDir}/e,MOVED_TO_DIR,
+${tmpDir}/d,CREATE_DIR,
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/d/a.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/d/a.txt,CREATE,
+${tmpDir}/d/a.txt,CLOSE_WRITE,ef46db3751d8e999
 `);
   });
   watcher.dispose();
 });
 
-test("rename when moved_from folder name is longer than moved_to", async () => {
+test("hash - forget only the digests below a moved folder", async () => {
   const tmpDir = await getTmpDir();
-  await mkdir(`${tmpDir}/f2`);
-  await mkdir(`${tmpDir}/a/b/c`, { recursive: true });
-  const watcher = await createWatcher([tmpDir]);
-  await rename(`${tmpDir}/a`, `${tmpDir}/f`);
+  await mkdir(`${tmpDir}/d/e`, { recursive: true });
+  await mkdir(`${tmpDir}/d2`);
+  await writeFile(`${tmpDir}/d/e/a.txt`, "");
+  await writeFile(`${tmpDir}/d2/a.txt`, "");
+  const watcher = await createWatcher([tmpDir, "--hash"]);
+  await appendFile(`${tmpDir}/d/e/a.txt`, "");
+  await appendFile(`${tmpDir}/d2/a.txt`, "");
   await waitForExpect(() => {
-    expect(watcher.stdout).toBe(`${tmpDir}/a,MOVED_FROM_DIR
-${tmpDir}/f,MOVED_TO_DIR
+    expect(watcher.stdout).toBe(`${tmpDir}/d/e/a.txt,CLOSE_WRITE,ef46db3751d8e999
+${tmpDir}/d2/a.txt,CLOSE_WRITE,ef46db3751d8e999
 `);
   });
+  await rename(`${tmpDir}/d`, `${tmpDir}/f`);
+  await mkdir(`${tmpDir}/d/e`, { recursive: true });
+  await waitForExpect(() => {
+    expect(watcher.stdout).toContain(`${tmpDir}/d/e,CREATE_DIR,`);
+  });
   watcher.clear();
-  await writeFile(`${tmpDir}/f/g.txt`, "");
+  await writeFile(`${tmpDir}/d/e/a.txt`, "");
+  await appendFile(`${tmpDir}/d2/a.txt`, "");
   await waitForExpect(() => {
-    expect(watcher.stdout).toBe(`${tmpDir}/f/g.txt,CREATE
-${tmpDir}/f/g.txt,CLOSE_WRITE
+    expect(watcher.stdout).toBe(`${tmpDir}/d/e/a.txt,CREATE,
+${tmpDir}/d/e/a.txt,CLOSE_WRITE,ef46db3751d8e999
+`);
+  });
+  watcher.dispose();
+});
+
+test("hash - least recently used digest is evicted", async () => {
+  const tmpDir = await getTmpDir();
+  await writeFile(`${tmpDir}/a.txt`, "");
+  await writeFile(`${tmpDir}/b.txt`, "");
+  const watcher = await createWatcher([
+    tmpDir,
+    "--hash",
+    "--hash-cache-size",
+    "1",
+  ]);
+  await appendFile(`${tmpDir}/a.txt`, "");
+  await appendFile(`${tmpDir}/b.txt`, "");
+  await appendFile(`${tmpDir}/b.txt`, "");
+  await appendFile(`${tmpDir}/a.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a.txt,CLOSE_WRITE,ef46db3751d8e999
+${tmpDir}/b.txt,CLOSE_WRITE,ef46db3751d8e999
+${tmpDir}/a.txt,CLOSE_WRITE,ef46db3751d8e999
+`);
+  });
+  watcher.dispose();
+});
+
+test("hash - file larger than max size is not hashed", async () => {
+  const tmpDir = await getTmpDir();
+  await writeFile(`${tmpDir}/a.txt`, "abcd");
+  const watcher = await createWatcher([
+    tmpDir,
+    "--hash",
+    "--hash-max-size",
+    "3",
+  ]);
+  await appendFile(`${tmpDir}/a.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a.txt,CLOSE_WRITE,
+`);
+  });
+  await appendFile(`${tmpDir}/a.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a.txt,CLOSE_WRITE,
+${tmpDir}/a.txt,CLOSE_WRITE,
+`);
+  });
+  watcher.dispose();
+});
+
+test("with stat - create file", async () => {
+  const tmpDir = await getTmpDir();
+  const watcher = await createWatcher([tmpDir, "--with-stat"]);
+  await writeFile(`${tmpDir}/abc.txt`, "abc");
+  await waitForExpect(() => {
+    expect(watcher.stdout.split("\n")).toEqual([
+      expect.stringMatching(/,CREATE,file,\d+,\d+\.\d{9},\d+$/),
+      expect.stringMatching(/,MODIFY,file,3,\d+\.\d{9},\d+$/),
+      expect.stringMatching(/,CLOSE_WRITE,file,3,\d+\.\d{9},\d+$/),
+      "",
+    ]);
+  });
+  watcher.dispose();
+});
+
+test("with stat - folder, symlink and removed file", async () => {
+  const tmpDir = await getTmpDir();
+  await writeFile(`${tmpDir}/a.txt`, "");
+  const watcher = await createWatcher([tmpDir, "--with-stat"]);
+  await mkdir(`${tmpDir}/b`);
+  await symlink(`${tmpDir}/b`, `${tmpDir}/c`);
+  await rm(`${tmpDir}/a.txt`);
+  await waitForExpect(() => {
+    expect(watcher.stdout.split("\n")).toEqual([
+      expect.stringMatching(/\/b,CREATE_DIR,dir,\d+,\d+\.\d{9},\d+$/),
+      expect.stringMatching(/\/c,CREATE,symlink,\d+,\d+\.\d{9},\d+$/),
+      `${tmpDir}/a.txt,DELETE,,,,`,
+      "",
+    ]);
+  });
+  watcher.dispose();
+});
+
+test("with stat and hash - columns stay the same", async () => {
+  const tmpDir = await getTmpDir();
+  const watcher = await createWatcher([tmpDir, "--with-stat", "--hash"]);
+  await writeFile(`${tmpDir}/abc.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout.split("\n")).toEqual([
+      expect.stringMatching(/,CREATE,,file,0,\d+\.\d{9},\d+$/),
+      expect.stringMatching(
+        /,CLOSE_WRITE,ef46db3751d8e999,file,0,\d+\.\d{9},\d+$/
+      ),
+      "",
+    ]);
+  });
+  watcher.dispose();
+});
+
+test("socket - subscribe to folder", async () => {
+  const tmpDir = await getTmpDir();
+  const daemon = await createDaemon(`${tmpDir}.sock`);
+  const client = await createClient(`${tmpDir}.sock`, [`root ${tmpDir}`]);
+  expect(client.reply).toBe("OK");
+  await mkdir(`${tmpDir}/a`);
+  await writeFile(`${tmpDir}/1.txt`, "");
+  await waitForExpect(() => {
+    expect(client.stdout).toBe(`${tmpDir}/a,CREATE_DIR
+${tmpDir}/1.txt,CREATE
+${tmpDir}/1.txt,CLOSE_WRITE
+`);
+  });
+  client.dispose();
+  daemon.dispose();
+});
+
+test("socket - clients share watches and have their own filters", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a/b`, { recursive: true });
+  await mkdir(`${tmpDir}/c`);
+  const daemon = await createDaemon(`${tmpDir}.sock`);
+  const all = await createClient(`${tmpDir}.sock`, [`root ${tmpDir}`]);
+  const filtered = await createClient(`${tmpDir}.sock`, [
+    `root ${tmpDir}/c/../a`,
+    "event CLOSE_WRITE",
+    "exclude b",
+  ]);
+  expect(filtered.reply).toBe("OK");
+  await writeFile(`${tmpDir}/a/1.txt`, "");
+  await writeFile(`${tmpDir}/a/b/2.txt`, "");
+  await writeFile(`${tmpDir}/c/3.txt`, "");
+  await waitForExpect(() => {
+    expect(all.stdout).toBe(`${tmpDir}/a/1.txt,CREATE
+${tmpDir}/a/1.txt,CLOSE_WRITE
+${tmpDir}/a/b/2.txt,CREATE
+${tmpDir}/a/b/2.txt,CLOSE_WRITE
+${tmpDir}/c/3.txt,CREATE
+${tmpDir}/c/3.txt,CLOSE_WRITE
+`);
+    expect(filtered.stdout).toBe(`${tmpDir}/a/1.txt,CLOSE_WRITE
+`);
+  });
+  // the nested folder stays watched when the outer client leaves
+  all.dispose();
+  filtered.clear();
+  await setTimeout(50);
+  await writeFile(`${tmpDir}/a/4.txt`, "");
+  await waitForExpect(() => {
+    expect(filtered.stdout).toBe(`${tmpDir}/a/4.txt,CLOSE_WRITE
+`);
+  });
+  filtered.dispose();
+  daemon.dispose();
+});
+
+test("socket - watches are removed when the last client leaves", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a`);
+  const daemon = await createDaemon(`${tmpDir}.sock`);
+  const client1 = await createClient(`${tmpDir}.sock`, [`root ${tmpDir}`]);
+  const client2 = await createClient(`${tmpDir}.sock`, [`root ${tmpDir}`]);
+  client1.dispose();
+  await setTimeout(50);
+  daemon.printStorage();
+  await waitForExpect(() => {
+    expect(daemon.stderr).toContain(`node: 2 ${tmpDir}/a\n`);
+  });
+  client2.dispose();
+  await setTimeout(50);
+  daemon.printStorage();
+  await waitForExpect(() => {
+    expect(daemon.stderr).toContain(`----- Storage -----\n\n`);
+  });
+  daemon.dispose();
+});
+
+test("socket - invalid root", async () => {
+  const tmpDir = await getTmpDir();
+  const daemon = await createDaemon(`${tmpDir}.sock`);
+  const client = await createClient(`${tmpDir}.sock`, [
+    `root ${tmpDir}/not-found`,
+  ]);
+  expect(client.reply).toBe("ERROR cannot watch root");
+  client.dispose();
+  daemon.dispose();
+});
+
+test("socket - root that cannot be watched fails only its client", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a`);
+  for (let i = 0; i < 50; i++) {
+    await mkdir(`${tmpDir}/b/${i}`, { recursive: true });
+  }
+  for (let i = 0; i < 10; i++) {
+    await mkdir(`${tmpDir}/c/${i}`, { recursive: true });
+  }
+  const daemon = await createDaemon(`${tmpDir}.sock`, 20);
+  const a = await createClient(`${tmpDir}.sock`, [`root ${tmpDir}/a`]);
+  expect(a.reply).toBe("OK");
+  const b = await createClient(`${tmpDir}.sock`, [`root ${tmpDir}/b`]);
+  expect(b.reply).toBe("ERROR cannot watch root");
+  // the watches of b have been removed again
+  const c = await createClient(`${tmpDir}.sock`, [`root ${tmpDir}/c`]);
+  expect(c.reply).toBe("OK");
+  await writeFile(`${tmpDir}/a/1.txt`, "");
+  await writeFile(`${tmpDir}/c/9/2.txt`, "");
+  await waitForExpect(() => {
+    expect(a.stdout).toBe(`${tmpDir}/a/1.txt,CREATE
+${tmpDir}/a/1.txt,CLOSE_WRITE
+`);
+    expect(c.stdout).toBe(`${tmpDir}/c/9/2.txt,CREATE
+${tmpDir}/c/9/2.txt,CLOSE_WRITE
+`);
+  });
+  a.dispose();
+  b.dispose();
+  c.dispose();
+  daemon.dispose();
+});
+
+test("max depth - deeper folders are not watched", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a/b`, { recursive: true });
+  const watcher = await createWatcher([tmpDir, "--max-depth", "1"]);
+  await writeFile(`${tmpDir}/a/b/2.txt`, "");
+  await writeFile(`${tmpDir}/a/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a/1.txt,CREATE
+${tmpDir}/a/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("max depth - moved folder is watched at its new depth", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a/b`, { recursive: true });
+  await mkdir(`${tmpDir}/c`);
+  const watcher = await createWatcher([tmpDir, "--max-depth", "1"]);
+  await rename(`${tmpDir}/c`, `${tmpDir}/a/c`);
+  await rename(`${tmpDir}/a/b`, `${tmpDir}/b`);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/c,MOVED_FROM_DIR
+${tmpDir}/a/c,MOVED_TO_DIR
+${tmpDir}/a/b,MOVED_FROM_DIR
+${tmpDir}/b,MOVED_TO_DIR
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/a/c/1.txt`, "");
+  await writeFile(`${tmpDir}/b/2.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/b/2.txt,CREATE
+${tmpDir}/b/2.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("lazy - only structural changes below max depth", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a/b`, { recursive: true });
+  const watcher = await createWatcher([tmpDir, "--lazy"]);
+  await writeFile(`${tmpDir}/a/b/2.txt`, "");
+  await writeFile(`${tmpDir}/a/1.txt`, "");
+  await rm(`${tmpDir}/a/1.txt`);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a/1.txt,CREATE
+${tmpDir}/a/1.txt,DELETE
+`);
+  });
+  watcher.dispose();
+});
+
+test("lazy - busy folder is watched fully until it is idle", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a`);
+  const watcher = await createWatcher([
+    tmpDir,
+    "--lazy",
+    "--idle-timeout",
+    "1",
+  ]);
+  // at least 8 of them within the same second
+  for (let i = 0; i < 16; i++) {
+    await writeFile(`${tmpDir}/a/${i}.txt`, "");
+  }
+  await waitForExpect(() => {
+    expect(watcher.stdout).toContain(`${tmpDir}/a/15.txt,CREATE\n`);
+  });
+  await appendFile(`${tmpDir}/a/0.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toContain(`${tmpDir}/a/0.txt,CLOSE_WRITE\n`);
+  });
+  watcher.clear();
+  await setTimeout(2500);
+  await appendFile(`${tmpDir}/a/0.txt`, "");
+  await writeFile(`${tmpDir}/a/16.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a/16.txt,CREATE
+`);
+  });
+  watcher.dispose();
+}, 10_000);
+
+test("lazy - activated folder is watched at every depth", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a/b/c`, { recursive: true });
+  const watcher = await createWatcher([tmpDir, "--lazy"]);
+  // at least 8 of them within the same second
+  for (let i = 0; i < 16; i++) {
+    await writeFile(`${tmpDir}/a/${i}.txt`, "");
+  }
+  await waitForExpect(() => {
+    expect(watcher.stdout).toContain(`${tmpDir}/a/15.txt,CREATE\n`);
+  });
+  await appendFile(`${tmpDir}/a/0.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toContain(`${tmpDir}/a/0.txt,CLOSE_WRITE\n`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/a/b/c/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a/b/c/1.txt,CREATE
+${tmpDir}/a/b/c/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.clear();
+  await mkdir(`${tmpDir}/a/b/c/d`);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a/b/c/d,CREATE_DIR
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/a/b/c/d/2.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a/b/c/d/2.txt,CREATE
+${tmpDir}/a/b/c/d/2.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+}, 10_000);
+
+test("cli invalid max depth", async () => {
+  const watcher = await createCliWatcher(["--max-depth", "-1", "/tmp"]);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`Usage: hello [ options ] sample-folder
+`);
+  });
+  watcher.dispose();
+});
+
+test("cli socket with shards", async () => {
+  const watcher = await createCliWatcher([
+    "--socket",
+    "/tmp/foo.sock",
+    "--shards",
+    "2",
+  ]);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`Usage: hello [ options ] sample-folder
+`);
+  });
+  watcher.dispose();
+});
+
+test("cli invalid shards", async () => {
+  const watcher = await createCliWatcher(["--shards", "0", "/tmp"]);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`Usage: hello [ options ] sample-folder
+`);
+  });
+  watcher.dispose();
+});
+
+// TODO test is failing in ci sometimes https://github.com/levivilet/c-watcher/runs/4059024632?check_suite_focus=true
+test.skip("symlinked file", async () => {
+  const tmpDir = await getTmpDir();
+  await writeFile(`${tmpDir}/a.txt`, "");
+  await symlink(`${tmpDir}/a.txt`, `${tmpDir}/b.txt`);
+  const watcher = await createWatcher([tmpDir]);
+  await writeFile(`${tmpDir}/a.txt`, "aaa");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a.txt,MODIFY
+${tmpDir}/a.txt,MODIFY
+${tmpDir}/a.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("symlinked folder", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a`);
+  await symlink(`${tmpDir}/a`, `${tmpDir}/b`);
+  const watcher = await createWatcher([tmpDir]);
+  await writeFile(`${tmpDir}/b/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a/1.txt,CREATE
+${tmpDir}/a/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("follow symlinks - symlinked folder", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a`);
+  await symlink(`${tmpDir}/a`, `${tmpDir}/b`);
+  const watcher = await createWatcher([tmpDir, "--follow-symlinks"]);
+  await writeFile(`${tmpDir}/b/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a/1.txt,CREATE
+${tmpDir}/b/1.txt,CREATE
+${tmpDir}/a/1.txt,CLOSE_WRITE
+${tmpDir}/b/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("follow symlinks - folder outside and cycle", async () => {
+  const tmpDir = await getTmpDir();
+  const tmpDir2 = await getTmpDir();
+  await mkdir(`${tmpDir2}/pkg`);
+  await symlink(`${tmpDir2}/pkg`, `${tmpDir}/pkg`);
+  // a symlink to its own parent is not walked forever
+  await symlink("..", `${tmpDir2}/pkg/up`);
+  const watcher = await createWatcher([tmpDir, "--follow-symlinks"]);
+  await writeFile(`${tmpDir2}/pkg/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/pkg/1.txt,CREATE
+${tmpDir}/pkg/up/pkg/1.txt,CREATE
+${tmpDir}/pkg/1.txt,CLOSE_WRITE
+${tmpDir}/pkg/up/pkg/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("follow symlinks - create and remove symlink", async () => {
+  const tmpDir = await getTmpDir();
+  const tmpDir2 = await getTmpDir();
+  await mkdir(`${tmpDir2}/pkg/lib`, { recursive: true });
+  const watcher = await createWatcher([tmpDir, "--follow-symlinks"]);
+  await symlink(`${tmpDir2}/pkg`, `${tmpDir}/pkg`);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/pkg,CREATE
+${tmpDir}/pkg/lib,CREATE_DIR
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir2}/pkg/lib/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/pkg/lib/1.txt,CREATE
+${tmpDir}/pkg/lib/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.clear();
+  await rm(`${tmpDir}/pkg`);
+  await writeFile(`${tmpDir2}/pkg/lib/2.txt`, "");
+  await writeFile(`${tmpDir}/3.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/pkg,DELETE
+${tmpDir}/3.txt,CREATE
+${tmpDir}/3.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("follow symlinks - remove one of two paths", async () => {
+  const tmpDir = await getTmpDir();
+  const tmpDir2 = await getTmpDir();
+  await mkdir(`${tmpDir2}/pkg/lib`, { recursive: true });
+  await symlink(`${tmpDir2}/pkg`, `${tmpDir}/x`);
+  await symlink(`${tmpDir2}/pkg`, `${tmpDir}/y`);
+  const watcher = await createWatcher([tmpDir, "--follow-symlinks"]);
+  await rm(`${tmpDir}/x`);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/x,DELETE
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir2}/pkg/lib/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/y/lib/1.txt,CREATE
+${tmpDir}/y/lib/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("follow symlinks - rename target of symlink", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a`);
+  await symlink(`${tmpDir}/a`, `${tmpDir}/b`);
+  const watcher = await createWatcher([tmpDir, "--follow-symlinks"]);
+  // b is left dangling
+  await rename(`${tmpDir}/a`, `${tmpDir}/c`);
+  await writeFile(`${tmpDir}/c/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a,MOVED_FROM_DIR
+${tmpDir}/c,MOVED_TO_DIR
+${tmpDir}/c/1.txt,CREATE
+${tmpDir}/c/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("follow symlinks - move out target of symlink", async () => {
+  const tmpDir = await getTmpDir();
+  const tmpDir2 = await getTmpDir();
+  await mkdir(`${tmpDir}/a/s`, { recursive: true });
+  await symlink(`${tmpDir}/a`, `${tmpDir}/b`);
+  const watcher = await createWatcher([tmpDir, "--follow-symlinks"]);
+  await rename(`${tmpDir}/a`, `${tmpDir2}/a`);
+  await writeFile(`${tmpDir2}/a/s/1.txt`, "");
+  await writeFile(`${tmpDir}/2.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a,MOVED_FROM_DIR
+${tmpDir}/2.txt,CREATE
+${tmpDir}/2.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+// TODO test hardlink
+
+test.skip("delete watched folder", async () => {
+  const tmpDir = await getTmpDir();
+  const watcher = await createWatcher([tmpDir]);
+  await rm(tmpDir, { recursive: true });
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(``);
+    expect(watcher.status).toBe("normal");
+  });
+  watcher.dispose();
+});
+
+test("cli help", async () => {
+  const watcher = await createCliWatcher(["--help"]);
+  await waitForExpect(() => {
+    expect(watcher.stdout.split("\n")).toEqual([
+      expect.stringMatching(/hello \d+\.\d+\.\d+/),
+      "Recursively watch a folder for changes",
+      "Usage: hello [ options ] sample-folder",
+      "Options:",
+      "\t-h|--help     \tShow this help text.",
+      "\t--exclude <name>",
+      "\t              \tExclude all events on files matching <name>",
+      "\t--shards <n>  \tSplit top-level folders across <n> inotify",
+      "\t              \tinstances, each read by its own thread",
+      "\t--hash        \tHash files on CLOSE_WRITE and skip the event",
+      "\t              \twhen the content did not change, the digest",
+      "\t              \tis printed in an extra column",
+      "\t--hash-max-size <bytes>",
+      "\t              \tDo not hash files larger than <bytes>",
+      "\t--hash-cache-size <n>",
+      "\t              \tRemember the digests of at most <n> files",
+      "\t--with-stat   \tAdd type, size, mtime and inode to each event",
+      "\t--socket <path>",
+      "\t              \tServe clients on the unix socket <path>, which",
+      "\t              \tsubscribe to folders instead of sample-folder",
+      "\t--max-depth <n>",
+      "\t              \tOnly watch folders up to <n> levels deep",
+      "\t--lazy        \tWatch the folders below --max-depth for created,",
+      "\t              \tdeleted and moved entries only and watch them",
+      "\t              \tfully while they are busy",
+      "\t--idle-timeout <seconds>",
+      "\t              \tWith --lazy, stop fully watching folders without",
+      "\t              \tevents for <seconds> (default 60)",
+      "\t--follow-symlinks",
+      "\t              \tWatch the folders that symlinks point to and",
+      "\t              \treport their events below every path of them",
+      "",
+    ]);
+  });
+  watcher.dispose();
+});
+
+test("cli version", async () => {
+  const watcher = await createCliWatcher(["--version"]);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toMatch(/hello \d+\.\d+\.\d+/);
+  });
+  watcher.dispose();
+});
+
+test("cli missing arguments", async () => {
+  const watcher = await createCliWatcher([]);
+  await waitForExpect(() => {
+    expect(watcher.stderr).toBe(`No files specified to watch!
+`);
+  });
+  watcher.dispose();
+});
+
+test("cli invalid option", async () => {
+  const watcher = await createCliWatcher(["--exclude   "]);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`Usage: hello [ options ] sample-folder
+`);
+  });
+  watcher.dispose();
+});
+
+test("cli unknown option", async () => {
+  const watcher = await createCliWatcher(["-k"]);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`Usage: hello [ options ] sample-folder
+`);
+  });
+  watcher.dispose();
+});
+
+// TODO move folder inside out
+
+test("rename when moved_to folder name is longer than moved_from", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a/b/c`, { recursive: true });
+  await mkdir(`${tmpDir}/f`);
+  const watcher = await createWatcher([tmpDir]);
+  await rename(`${tmpDir}/a`, `${tmpDir}/f2`);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a,MOVED_FROM_DIR
+${tmpDir}/f2,MOVED_TO_DIR
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/f2/g.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/f2/g.txt,CREATE
+${tmpDir}/f2/g.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("rename when moved_from folder name is longer than moved_to", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/f2`);
+  await mkdir(`${tmpDir}/a/b/c`, { recursive: true });
+  const watcher = await createWatcher([tmpDir]);
+  await rename(`${tmpDir}/a`, `${tmpDir}/f`);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a,MOVED_FROM_DIR
+${tmpDir}/f,MOVED_TO_DIR
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/f/g.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/f/g.txt,CREATE
+${tmpDir}/f/g.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("rename folder that is a prefix of another folder", async () => {
+  const tmpDir = await getTmpDir();
+  await mkdir(`${tmpDir}/a`);
+  await mkdir(`${tmpDir}/ab`);
+  const watcher = await createWatcher([tmpDir]);
+  await rename(`${tmpDir}/a`, `${tmpDir}/c`);
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a,MOVED_FROM_DIR
+${tmpDir}/c,MOVED_TO_DIR
+`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/ab/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/ab/1.txt,CREATE
+${tmpDir}/ab/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("move out nested folder, then move out another folder", async () => {
+  const tmpDir = await getTmpDir();
+  const tmpDir2 = await getTmpDir();
+  await mkdir(`${tmpDir}/a/b`, { recursive: true });
+  await mkdir(`${tmpDir}/c`);
+  await mkdir(`${tmpDir}/d`);
+  const watcher = await createWatcher([tmpDir]);
+  await rename(`${tmpDir}/a`, `${tmpDir2}/a`);
+  await rename(`${tmpDir}/c`, `${tmpDir2}/c`);
+  await writeFile(`${tmpDir}/d/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/a,MOVED_FROM_DIR
+${tmpDir}/c,MOVED_FROM_DIR
+${tmpDir}/d/1.txt,CREATE
+${tmpDir}/d/1.txt,CLOSE_WRITE
+`);
+  });
+  watcher.dispose();
+});
+
+test("shards - move folder from top-level folder to root and back", async () => {
+  const tmpDir = await getTmpDir();
+  const names = ["p", "q", "r", "s", "t", "u", "v", "w"];
+  await mkdir(`${tmpDir}/a/1/2`, { recursive: true });
+  await Promise.all(names.map((name) => mkdir(`${tmpDir}/${name}-next`)));
+  const watcher = await createWatcher([tmpDir, "--shards", "4"]);
+  let from = "a/1";
+  for (const name of names) {
+    await rename(`${tmpDir}/${from}`, `${tmpDir}/${name}`);
+    await rename(`${tmpDir}/${name}`, `${tmpDir}/${name}-next/1`);
+    from = `${name}-next/1`;
+  }
+  // both events of the last rename, they can come from different shards
+  await waitForExpect(() => {
+    const lines = watcher.stdout.split("\n");
+    expect(lines).toContain(`${tmpDir}/${names.at(-1)},MOVED_FROM_DIR`);
+    expect(lines).toContain(`${tmpDir}/${from},MOVED_TO_DIR`);
+  });
+  watcher.clear();
+  await writeFile(`${tmpDir}/${from}/2/1.txt`, "");
+  await waitForExpect(() => {
+    expect(watcher.stdout).toBe(`${tmpDir}/${from}/2/1.txt,CREATE
+${tmpDir}/${from}/2/1.txt,CLOSE_WRITE
 `);
   });
   watcher.dispose();